@@ -0,0 +1,293 @@
+/*
+ * cap2rep - convert an allocation log written by libcapture.so
+ *     (see capture.c) to a .rep trace that mdriver can replay
+ *
+ * usage: cap2rep <in.log> <out.rep>
+ *
+ * Records of all threads are merged by sequence number and replayed as
+ * one thread. Addresses are mapped to block ids, which are reused once
+ * their block is freed. Frees of blocks allocated before capture began
+ * are dropped, and blocks still live at the end are freed so that the
+ * trace is balanced. Timestamps and thread ids stay in the log.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "capture.h"
+#include "tracefmt.h"
+
+typedef struct entry {
+    uint64_t addr;
+    unsigned id;
+    unsigned size;
+    struct entry *next;
+} entry_t;
+
+typedef struct {
+    int type;       /* TRACE_ALLOC, TRACE_FREE or TRACE_REALLOC */
+    unsigned id;
+    unsigned size;
+} rep_op_t;
+
+static entry_t **table;
+static size_t table_size, live;
+static entry_t *spare;
+
+static unsigned *free_ids;
+static size_t num_free_ids, num_ids;
+
+static rep_op_t *ops;
+static size_t num_ops, max_ops;
+
+static size_t live_bytes, peak_bytes;
+static size_t unknown, conflicts, too_large;
+
+static void die(char *msg, char *path)
+{
+    fprintf(stderr, "cap2rep: %s: %s\n", path, msg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "cap2rep: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const capture_record_t *)a)->seq;
+    uint64_t y = ((const capture_record_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_tid(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static entry_t **bucket(uint64_t addr)
+{
+    return &table[((addr >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & (table_size - 1)];
+}
+
+static void grow_table(void)
+{
+    entry_t **old = table, *e, *next;
+    size_t i, old_size = table_size;
+
+    table_size = table_size ? 2 * table_size : 1024;
+    table = xrealloc(NULL, table_size * sizeof(entry_t *));
+    memset(table, 0, table_size * sizeof(entry_t *));
+    for (i = 0; i < old_size; i++)
+        for (e = old[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = *bucket(e->addr);
+            *bucket(e->addr) = e;
+        }
+    free(old);
+}
+
+/* Returns the slot that points to addr's entry, or to NULL if none */
+static entry_t **lookup(uint64_t addr)
+{
+    entry_t **p = bucket(addr);
+
+    while (*p != NULL && (*p)->addr != addr)
+        p = &(*p)->next;
+    return p;
+}
+
+static void emit(int type, unsigned id, unsigned size)
+{
+    if (num_ops == max_ops) {
+        max_ops = max_ops ? 2 * max_ops : 4096;
+        ops = xrealloc(ops, max_ops * sizeof(rep_op_t));
+    }
+    ops[num_ops].type = type;
+    ops[num_ops].id = id;
+    ops[num_ops].size = size;
+    num_ops++;
+}
+
+/* Takes addr's entry out of the table, keeping its id */
+static entry_t *unlink_entry(entry_t **slot)
+{
+    entry_t *e = *slot;
+
+    *slot = e->next;
+    live_bytes -= e->size;
+    live--;
+    return e;
+}
+
+static void release(entry_t **slot)
+{
+    entry_t *e = unlink_entry(slot);
+
+    emit(TRACE_FREE, e->id, 0);
+    free_ids[num_free_ids++] = e->id;
+    e->next = spare;
+    spare = e;
+}
+
+static void add(uint64_t addr, unsigned id, unsigned size)
+{
+    entry_t **slot, *e;
+
+    /* An address that is still live was freed by a record that lost a
+       race for its sequence number */
+    if (*(slot = lookup(addr)) != NULL) {
+        conflicts++;
+        release(slot);
+    }
+
+    if (live >= table_size)
+        grow_table();
+    if ((e = spare) != NULL)
+        spare = e->next;
+    else
+        e = xrealloc(NULL, sizeof(entry_t));
+    e->addr = addr;
+    e->id = id;
+    e->size = size;
+    e->next = *bucket(addr);
+    *bucket(addr) = e;
+    live++;
+
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+static unsigned new_id(void)
+{
+    if (num_free_ids > 0)
+        return free_ids[--num_free_ids];
+    free_ids = xrealloc(free_ids, (num_ids + 1) * sizeof(unsigned));
+    return num_ids++;
+}
+
+static void do_record(capture_record_t *r)
+{
+    entry_t **slot, *e;
+    unsigned size, id;
+
+    if (r->size > UINT_MAX) {
+        too_large++;
+        return;
+    }
+    size = r->size ? r->size : 1;
+
+    switch (r->op) {
+    case CAPTURE_MALLOC:
+        id = new_id();
+        emit(TRACE_ALLOC, id, size);
+        add(r->result, id, size);
+        break;
+
+    case CAPTURE_FREE:
+        if (*(slot = lookup(r->ptr)) != NULL)
+            release(slot);
+        else
+            unknown++;
+        break;
+
+    case CAPTURE_REALLOC:
+        slot = r->ptr ? lookup(r->ptr) : NULL;
+        if (r->result == 0) {
+            /* realloc(p, 0) freed p */
+            if (slot != NULL && *slot != NULL)
+                release(slot);
+            else if (r->ptr)
+                unknown++;
+        } else if (slot != NULL && *slot != NULL) {
+            e = unlink_entry(slot);
+            emit(TRACE_REALLOC, e->id, size);
+            id = e->id;
+            e->next = spare;
+            spare = e;
+            add(r->result, id, size);
+        } else {
+            if (r->ptr)
+                unknown++;
+            id = new_id();
+            emit(TRACE_ALLOC, id, size);
+            add(r->result, id, size);
+        }
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    char magic[sizeof(CAPTURE_MAGIC)];
+    capture_record_t *records = NULL;
+    uint32_t *tids;
+    size_t n = 0, max = 0, i, threads;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: cap2rep <in.log> <out.rep>\n");
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "rb")) == NULL)
+        die("cannot open", argv[1]);
+    if (fread(magic, sizeof(magic), 1, in) != 1
+        || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0)
+        die("not an allocation log", argv[1]);
+
+    for (;;) {
+        if (n == max) {
+            max = max ? 2 * max : 65536;
+            records = xrealloc(records, max * sizeof(capture_record_t));
+        }
+        if (fread(&records[n], sizeof(capture_record_t), 1, in) != 1)
+            break;
+        n++;
+    }
+    fclose(in);
+
+    qsort(records, n, sizeof(capture_record_t), compare_seq);
+    grow_table();
+    for (i = 0; i < n; i++)
+        do_record(&records[i]);
+    for (i = 0; i < table_size; i++)
+        while (table[i] != NULL)
+            release(&table[i]);
+
+    if ((out = fopen(argv[2], "w")) == NULL)
+        die("cannot create", argv[2]);
+    fprintf(out, "%zu\n%zu\n%zu\n1\n", peak_bytes, num_ids, num_ops);
+    for (i = 0; i < num_ops; i++) {
+        if (ops[i].type == TRACE_FREE)
+            fprintf(out, "f %u\n", ops[i].id);
+        else
+            fprintf(out, "%c %u %u\n", ops[i].type == TRACE_ALLOC ? 'a' : 'r',
+                    ops[i].id, ops[i].size);
+    }
+    if (fclose(out) != 0)
+        die("write failed", argv[2]);
+
+    tids = xrealloc(NULL, (n + 1) * sizeof(uint32_t));
+    for (i = 0; i < n; i++)
+        tids[i] = records[i].tid;
+    qsort(tids, n, sizeof(uint32_t), compare_tid);
+    for (i = 0, threads = 0; i < n; i++)
+        threads += (i == 0 || tids[i] != tids[i - 1]);
+
+    fprintf(stderr, "%zu records from %zu threads, %zu ops on %zu ids\n",
+            n, threads, num_ops, num_ids);
+    if (unknown || conflicts || too_large)
+        fprintf(stderr, "dropped %zu frees of unknown blocks, %zu oversized "
+                "requests; %zu address conflicts\n", unknown, too_large, conflicts);
+    return 0;
+}
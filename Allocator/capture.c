@@ -0,0 +1,285 @@
+/*
+ * capture.c - LD_PRELOAD shim that logs a process's allocations
+ *
+ *   unix> MM_CAPTURE=friendlist.cap LD_PRELOAD=./libcapture.so ./friendlist 8090
+ *   unix> cap2rep friendlist.cap friendlist.rep
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are passed
+ * on to glibc through its __libc_ entry points, and each call is
+ * recorded in a buffer private to the calling thread. A full buffer is
+ * appended to the log with a single write(), so threads never take a
+ * lock; buffers of threads that are still running are flushed when the
+ * process exits. A thread's buffer is flushed when it exits and then
+ * handed to the next new thread, and calls made later in its exit are
+ * written one at a time. The log defaults to capture.<pid>.log.
+ *
+ * A forked child stops recording, since it would otherwise append to
+ * the parent's log. Servers are usually stopped with a signal, so
+ * SIGINT and SIGTERM also flush the buffers unless the program handles
+ * them itself.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "capture.h"
+
+#define BUFFER_RECORDS 4096
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+/* One thread's records; all buffers are on a list for the exit flush */
+typedef struct buffer {
+    struct buffer *next;
+    int count;
+    int busy;           /* owned by a running thread */
+    capture_record_t records[BUFFER_RECORDS];
+} buffer_t;
+
+static int log_fd = -1;
+static int recording;
+static uint64_t next_seq;
+static buffer_t *all_buffers;
+static pthread_key_t buffer_key;
+
+static __thread buffer_t *my_buffer;
+static __thread uint32_t my_tid;
+static __thread int exited;
+
+/* The count is taken atomically because a thread that is exiting and
+   the exit flush of the whole process may both flush its buffer */
+static void flush(buffer_t *b)
+{
+    size_t n = __atomic_exchange_n(&b->count, 0, __ATOMIC_ACQ_REL)
+               * sizeof(capture_record_t);
+    char *p = (char *)b->records;
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = write(log_fd, p, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            recording = 0;
+            break;
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+/* Runs when a thread exits */
+static void thread_done(void *b)
+{
+    flush(b);
+    my_buffer = NULL;
+    exited = 1;
+    __atomic_store_n(&((buffer_t *)b)->busy, 0, __ATOMIC_RELEASE);
+}
+
+static buffer_t *get_buffer(void)
+{
+    buffer_t *b = my_buffer;
+    int idle = 0;
+
+    if (b != NULL)
+        return b;
+
+    for (b = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        if (__atomic_compare_exchange_n(&b->busy, &idle, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        else
+            idle = 0;
+
+    if (b == NULL) {
+        /* mmap, since malloc would come back here */
+        b = mmap(NULL, sizeof(buffer_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED)
+            return NULL;
+        b->count = 0;
+        b->busy = 1;
+        b->next = __atomic_load_n(&all_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_buffers, &b->next, b, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    my_buffer = b;
+    pthread_setspecific(buffer_key, b);
+    return b;
+}
+
+static uint64_t take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static void record(uint64_t seq, int op, void *ptr, size_t size, void *result)
+{
+    buffer_t *b = NULL;
+    capture_record_t *r, last;
+    struct timespec ts;
+
+    if (!recording)
+        return;
+    if (exited)
+        r = &last;
+    else if ((b = get_buffer()) != NULL)
+        r = &b->records[b->count];
+    else
+        return;
+
+    if (my_tid == 0)
+        my_tid = syscall(SYS_gettid);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->seq = seq;
+    r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->ptr = (uintptr_t)ptr;
+    r->size = size;
+    r->result = (uintptr_t)result;
+    r->tid = my_tid;
+    r->op = op;
+
+    if (b == NULL) {
+        if (write(log_fd, r, sizeof(*r)) != sizeof(*r))
+            recording = 0;
+    } else if (++b->count == BUFFER_RECORDS)
+        flush(b);
+}
+
+static void flush_all(void)
+{
+    buffer_t *b;
+
+    recording = 0;
+    for (b = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        flush(b);
+}
+
+/* flush() only calls write(), so this is safe in a handler */
+static void flush_and_die(int sig)
+{
+    flush_all();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void catch_signal(int sig)
+{
+    struct sigaction sa;
+
+    if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL)
+        signal(sig, flush_and_die);
+}
+
+static void stop_in_child(void)
+{
+    recording = 0;
+}
+
+static void __attribute__((constructor)) capture_init(void)
+{
+    char *path = getenv("MM_CAPTURE"), name[64];
+
+    if (path == NULL) {
+        snprintf(name, sizeof(name), "capture.%d.log", (int)getpid());
+        path = name;
+    }
+    if ((log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0) {
+        fprintf(stderr, "capture: cannot open %s\n", path);
+        return;
+    }
+    if (write(log_fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != sizeof(CAPTURE_MAGIC))
+        return;
+
+    pthread_key_create(&buffer_key, thread_done);
+    pthread_atfork(NULL, NULL, stop_in_child);
+    catch_signal(SIGINT);
+    catch_signal(SIGTERM);
+    recording = 1;
+}
+
+static void __attribute__((destructor)) capture_done(void)
+{
+    if (!recording)
+        return;
+    flush_all();
+    close(log_fd);
+}
+
+static void *record_alloc(void *p, size_t size)
+{
+    if (p != NULL)
+        record(take_seq(), CAPTURE_MALLOC, NULL, size, p);
+    return p;
+}
+
+void *malloc(size_t size)
+{
+    return record_alloc(__libc_malloc(size), size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    return record_alloc(__libc_calloc(n, size), n * size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return record_alloc(__libc_memalign(alignment, size), size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return record_alloc(__libc_memalign(alignment, size), size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if ((p = record_alloc(__libc_memalign(alignment, size), size)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    return record_alloc(__libc_memalign(sysconf(_SC_PAGESIZE), size), size);
+}
+
+void free(void *p)
+{
+    if (p == NULL)
+        return;
+    record(take_seq(), CAPTURE_FREE, p, 0, NULL);
+    __libc_free(p);
+}
+
+/* A realloc that moves the block frees the old one before this records
+   it, so another thread may log a reuse of that address first; cap2rep
+   counts such records as conflicts. */
+void *realloc(void *p, size_t size)
+{
+    void *q = __libc_realloc(p, size);
+
+    if (q != NULL || size == 0)
+        record(take_seq(), CAPTURE_REALLOC, p, size, q);
+    return q;
+}
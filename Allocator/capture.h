@@ -0,0 +1,29 @@
+/*
+ * capture.h - allocation logs written by libcapture.so
+ *
+ * A log is CAPTURE_MAGIC followed by capture_record_t records. Each
+ * thread buffers its own records and appends them a buffer at a time,
+ * so records of different threads are interleaved in blocks; `seq`
+ * gives their order. A free takes its number before the block is
+ * released, and an allocation after it is returned, so an address
+ * that one thread frees and another reuses is seen in that order.
+ */
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "MMCAPT1"
+
+enum {
+    CAPTURE_MALLOC,   /* size -> result; also calloc and aligned allocs */
+    CAPTURE_FREE,     /* ptr */
+    CAPTURE_REALLOC   /* ptr, size -> result */
+};
+
+typedef struct {
+    uint64_t seq;     /* position in the process-wide order */
+    uint64_t ns;      /* CLOCK_MONOTONIC time of the call */
+    uint64_t ptr;     /* block passed in, if any */
+    uint64_t size;    /* bytes requested */
+    uint64_t result;  /* block returned, if any */
+    uint32_t tid;     /* calling thread */
+    uint32_t op;
+} capture_record_t;
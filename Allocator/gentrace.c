@@ -0,0 +1,533 @@
+/*
+ * gentrace - generate a synthetic .rep trace from a workload model
+ *
+ * usage: gentrace [-s <seed>] [-n <ops>] -w <workload> <out.rep>
+ *
+ * Workloads:
+ *   mixed     sizes from a mixture of size classes, each block living
+ *             for a short, medium or long time or until the end
+ *   prodcons  producers queue messages on a few FIFO queues and
+ *             consumers free them oldest first, sometimes in batches
+ *   web       requests in flight at once each allocate a burst of
+ *             objects and a growing response buffer, then free them
+ *             all when they finish; a few objects outlive them in a
+ *             session cache
+ *   cache     a long-lived key/value cache with approximate LRU
+ *             eviction, under a stream of short-lived temporaries
+ *
+ * All the workloads draw sizes from the same mixture: a few hot sizes
+ * picked from the seed (the structs a program allocates over and
+ * over), and otherwise log-uniform sizes from classes weighted toward
+ * small blocks. Every random number comes from one splitmix64 stream
+ * seeded by -s, and only integer arithmetic is used, so a seed gives
+ * the same trace on any system. After <ops> requests (default 50000)
+ * everything still allocated is freed, so every trace is balanced. The
+ * header's heap size is the peak of allocated bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+/* A weighted range of sizes in bytes, or of lifetimes in requests */
+typedef struct {
+    int weight;
+    unsigned lo, hi;
+} range_t;
+
+typedef struct {
+    char type;
+    int id;
+    unsigned size;
+} op_t;
+
+typedef struct {
+    unsigned long when;
+    int id;
+} death_t;
+
+#define FOREVER 0 /* a lifetime range with lo == FOREVER never dies */
+#define NUM_HOT 8 /* hot sizes */
+
+static const range_t size_classes[] = {
+    {50, 16, 64},
+    {25, 65, 256},
+    {15, 257, 2048},
+    {8, 2049, 32768},
+    {2, 32769, 262144},
+};
+
+static const range_t lifetimes[] = {
+    {60, 1, 32},
+    {30, 33, 4096},
+    {9, 4097, 65536},
+    {1, FOREVER, FOREVER},
+};
+
+#define NELEMS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static unsigned long long rng_state;
+static unsigned hot_sizes[NUM_HOT];
+
+static op_t *ops;               /* the trace so far */
+static unsigned long num_ops, max_ops;
+static unsigned *sizes;         /* size of each id, 0 once freed */
+static int *live_pos;           /* index of each id in live */
+static int num_ids, max_ids;
+static int *live;               /* ids allocated and not yet freed */
+static int num_live;
+static unsigned long long live_bytes, peak_bytes;
+static death_t *deaths;         /* min-heap of scheduled frees */
+static int num_deaths, max_deaths;
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "gentrace: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+#define GROW(array, num, max) \
+    do { \
+        if ((num) == (max)) { \
+            (max) = (max) ? 2 * (max) : 1024; \
+            (array) = xrealloc((array), (max) * sizeof(*(array))); \
+        } \
+    } while (0)
+
+/*****************
+ * Random numbers
+ *****************/
+
+static unsigned long long rng_next(void)
+{
+    unsigned long long z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n), without modulo bias */
+static unsigned long long rng_below(unsigned long long n)
+{
+    unsigned long long x, limit = -n % n;
+
+    while ((x = rng_next()) < limit)
+        ;
+    return x % n;
+}
+
+/* True with probability pct/100 */
+static int rng_pct(unsigned pct)
+{
+    return rng_below(100) < pct;
+}
+
+static int log2_floor(unsigned x)
+{
+    int k = 0;
+
+    while (x >>= 1)
+        k++;
+    return k;
+}
+
+/* About log-uniform in [lo, hi]: each power of two between them is
+   equally likely, and values within one are uniform */
+static unsigned log_uniform(unsigned lo, unsigned hi)
+{
+    int k = log2_floor(lo) + rng_below(log2_floor(hi) - log2_floor(lo) + 1);
+    unsigned a = 1U << k, b = (k == 31) ? UINT_MAX : (2U << k) - 1;
+
+    if (a < lo)
+        a = lo;
+    if (b > hi)
+        b = hi;
+    return a + rng_below((unsigned long long)b - a + 1);
+}
+
+static const range_t *pick(const range_t *mix, int n)
+{
+    int i, total = 0, r;
+
+    for (i = 0; i < n; i++)
+        total += mix[i].weight;
+    r = rng_below(total);
+    for (i = 0; r >= mix[i].weight; i++)
+        r -= mix[i].weight;
+    return &mix[i];
+}
+
+/* 40% of blocks are one of the hot sizes, the first ones most often */
+static unsigned draw_size(void)
+{
+    const range_t *c;
+
+    if (rng_pct(40))
+        return hot_sizes[rng_below(1 + rng_below(NUM_HOT))];
+    c = pick(size_classes, NELEMS(size_classes));
+    return log_uniform(c->lo, c->hi);
+}
+
+/* Lifetime in requests, or FOREVER */
+static unsigned draw_lifetime(void)
+{
+    const range_t *c = pick(lifetimes, NELEMS(lifetimes));
+
+    return (c->lo == FOREVER) ? FOREVER : log_uniform(c->lo, c->hi);
+}
+
+/************
+ * Requests
+ ************/
+
+static void emit(char type, int id, unsigned size)
+{
+    GROW(ops, num_ops, max_ops);
+    ops[num_ops].type = type;
+    ops[num_ops].id = id;
+    ops[num_ops].size = size;
+    num_ops++;
+}
+
+static int do_alloc(unsigned size)
+{
+    int id = num_ids++;
+
+    if (num_ids > max_ids) {
+        max_ids = max_ids ? 2 * max_ids : 1024;
+        sizes = xrealloc(sizes, max_ids * sizeof(*sizes));
+        live_pos = xrealloc(live_pos, max_ids * sizeof(*live_pos));
+        live = xrealloc(live, max_ids * sizeof(*live));
+    }
+    sizes[id] = size;
+    live_pos[id] = num_live;
+    live[num_live++] = id;
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+    emit('a', id, size);
+    return id;
+}
+
+static void do_realloc(int id, unsigned size)
+{
+    live_bytes += (unsigned long long)size - sizes[id];
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+    sizes[id] = size;
+    emit('r', id, size);
+}
+
+static void do_free(int id)
+{
+    int last = live[--num_live];
+
+    live[live_pos[id]] = last;
+    live_pos[last] = live_pos[id];
+    live_bytes -= sizes[id];
+    sizes[id] = 0;
+    emit('f', id, 0);
+}
+
+/* Free id once lifetime more requests have been made */
+static void schedule_free(int id, unsigned lifetime)
+{
+    int i = num_deaths, parent;
+    death_t d = {num_ops + lifetime, id};
+
+    if (lifetime == FOREVER)
+        return;
+    GROW(deaths, num_deaths, max_deaths);
+    for (num_deaths++; i > 0 && deaths[parent = (i - 1) / 2].when > d.when; i = parent)
+        deaths[i] = deaths[parent];
+    deaths[i] = d;
+}
+
+static death_t pop_death(void)
+{
+    death_t top = deaths[0], d = deaths[--num_deaths];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < num_deaths) {
+        if (child + 1 < num_deaths && deaths[child + 1].when < deaths[child].when)
+            child++;
+        if (d.when <= deaths[child].when)
+            break;
+        deaths[i] = deaths[child];
+        i = child;
+    }
+    deaths[i] = d;
+    return top;
+}
+
+/* Make the frees that are due */
+static void reap(void)
+{
+    death_t d;
+
+    while (num_deaths > 0 && deaths[0].when <= num_ops) {
+        d = pop_death();
+        if (sizes[d.id])
+            do_free(d.id);
+    }
+}
+
+/* Free everything still allocated: what was scheduled in order, then
+   the rest oldest first */
+static void drain(void)
+{
+    death_t d;
+    int id;
+
+    while (num_deaths > 0) {
+        d = pop_death();
+        if (sizes[d.id])
+            do_free(d.id);
+    }
+    for (id = 0; id < num_ids; id++)
+        if (sizes[id])
+            do_free(id);
+}
+
+/************
+ * Workloads
+ ************/
+
+static void gen_mixed(unsigned long n)
+{
+    int id;
+
+    while (num_ops < n) {
+        reap();
+        if (num_live > 0 && rng_pct(5)) {
+            id = live[rng_below(num_live)];
+            do_realloc(id, draw_size());
+            continue;
+        }
+        id = do_alloc(draw_size());
+        schedule_free(id, draw_lifetime());
+    }
+}
+
+#define QUEUES 4
+
+static void gen_prodcons(unsigned long n)
+{
+    struct {
+        int *ring;
+        int cap, head, count;
+        unsigned lo, hi;        /* message sizes */
+    } q[QUEUES];
+    int i, id, batch;
+
+    for (i = 0; i < QUEUES; i++) {
+        q[i].cap = log_uniform(64, 2048);
+        q[i].ring = xrealloc(NULL, q[i].cap * sizeof(int));
+        q[i].head = q[i].count = 0;
+        q[i].lo = log_uniform(16, 4096);
+        q[i].hi = q[i].lo * 4;
+    }
+
+    while (num_ops < n) {
+        i = rng_below(QUEUES);
+        if (q[i].count == 0 || (q[i].count < q[i].cap && rng_pct(60))) {
+            /* Produce, sometimes appending to the message first */
+            id = do_alloc(log_uniform(q[i].lo, q[i].hi));
+            if (rng_pct(25))
+                do_realloc(id, sizes[id] + log_uniform(16, q[i].lo));
+            q[i].ring[(q[i].head + q[i].count++) % q[i].cap] = id;
+            continue;
+        }
+        /* Consume, oldest first */
+        batch = rng_pct(10) ? log_uniform(1, 16) : 1;
+        while (batch-- > 0 && q[i].count > 0) {
+            do_free(q[i].ring[q[i].head]);
+            q[i].head = (q[i].head + 1) % q[i].cap;
+            q[i].count--;
+        }
+    }
+    for (i = 0; i < QUEUES; i++)
+        free(q[i].ring);
+}
+
+#define IN_FLIGHT 8
+
+static void gen_web(unsigned long n)
+{
+    struct {
+        int *objs;
+        int num_objs, max_objs;
+        int budget;             /* objects left to allocate */
+        int response;           /* id of the response buffer */
+    } r[IN_FLIGHT];
+    unsigned size;
+    int i, j, id;
+
+    for (i = 0; i < IN_FLIGHT; i++) {
+        r[i].objs = NULL;
+        r[i].max_objs = 0;
+        r[i].budget = 0;
+    }
+
+    while (num_ops < n) {
+        reap();
+        i = rng_below(IN_FLIGHT);
+        if (r[i].budget == 0) {
+            /* Start a request */
+            r[i].num_objs = 0;
+            r[i].budget = log_uniform(8, 256);
+            r[i].response = do_alloc(1024);
+        } else if (--r[i].budget == 0) {
+            /* Finish it, freeing its objects in either order */
+            if (rng_pct(50))
+                for (j = 0; j < r[i].num_objs; j++)
+                    do_free(r[i].objs[j]);
+            else
+                for (j = r[i].num_objs - 1; j >= 0; j--)
+                    do_free(r[i].objs[j]);
+            do_free(r[i].response);
+        } else if (rng_pct(12)) {
+            /* Double the response buffer */
+            size = sizes[r[i].response];
+            if (size < 131072)
+                do_realloc(r[i].response, 2 * size);
+        } else {
+            size = draw_size();
+            if (size > 8192)
+                size = log_uniform(16, 8192);
+            id = do_alloc(size);
+            if (rng_pct(2)) {
+                /* Outlives the request in the session cache */
+                schedule_free(id, log_uniform(4096, 131072));
+                continue;
+            }
+            GROW(r[i].objs, r[i].num_objs, r[i].max_objs);
+            r[i].objs[r[i].num_objs++] = id;
+        }
+    }
+    for (i = 0; i < IN_FLIGHT; i++)
+        free(r[i].objs);
+}
+
+#define CACHE_ENTRIES 4096
+#define LRU_SAMPLES 4
+
+static void gen_cache(unsigned long n)
+{
+    struct {
+        int key, value;
+        unsigned long last_use;
+    } *e = xrealloc(NULL, CACHE_ENTRIES * sizeof(*e));
+    int num_entries = 0, i, k, victim;
+
+    while (num_ops < n) {
+        reap();
+        if (rng_pct(70)) {
+            /* A temporary */
+            schedule_free(do_alloc(draw_size()), log_uniform(1, 64));
+        } else if (num_entries > 0 && rng_pct(33)) {
+            /* A hit, which sometimes stores a new value */
+            i = rng_below(num_entries);
+            e[i].last_use = num_ops;
+            if (rng_pct(20))
+                do_realloc(e[i].value, log_uniform(64, 16384));
+        } else {
+            /* A miss: evict the least recently used of a few entries if
+               the cache is full, then insert */
+            if (num_entries == CACHE_ENTRIES) {
+                victim = rng_below(num_entries);
+                for (k = 1; k < LRU_SAMPLES; k++) {
+                    i = rng_below(num_entries);
+                    if (e[i].last_use < e[victim].last_use)
+                        victim = i;
+                }
+                do_free(e[victim].key);
+                do_free(e[victim].value);
+                e[victim] = e[--num_entries];
+            }
+            e[num_entries].key = do_alloc(log_uniform(16, 128));
+            e[num_entries].value = do_alloc(log_uniform(64, 16384));
+            e[num_entries++].last_use = num_ops;
+        }
+    }
+    free(e);
+}
+
+static const struct {
+    char *name;
+    void (*gen)(unsigned long n);
+} workloads[] = {
+    {"mixed", gen_mixed},
+    {"prodcons", gen_prodcons},
+    {"web", gen_web},
+    {"cache", gen_cache},
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: gentrace [-s <seed>] [-n <ops>] -w <workload> <out.rep>\n");
+    fprintf(stderr, "workloads: mixed, prodcons, web, cache\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long seed = 1;
+    unsigned long n = 50000, i;
+    int c, w = -1;
+    FILE *out;
+
+    while ((c = getopt(argc, argv, "s:n:w:")) != EOF) {
+        switch (c) {
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            n = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            for (w = 0; w < NELEMS(workloads); w++)
+                if (strcmp(optarg, workloads[w].name) == 0)
+                    break;
+            if (w == NELEMS(workloads))
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (w < 0 || argc - optind != 1 || n == 0 || n > INT_MAX / 2)
+        usage();
+
+    rng_state = seed;
+    for (i = 0; i < NUM_HOT; i++)
+        hot_sizes[i] = log_uniform(16, 512);
+    workloads[w].gen(n);
+    drain();
+
+    if ((out = fopen(argv[optind], "w")) == NULL) {
+        fprintf(stderr, "gentrace: %s: cannot create\n", argv[optind]);
+        exit(1);
+    }
+    fprintf(out, "%llu\n%d\n%lu\n1\n",
+            peak_bytes < INT_MAX ? peak_bytes : INT_MAX, num_ids, num_ops);
+    for (i = 0; i < num_ops; i++) {
+        if (ops[i].type == 'f')
+            fprintf(out, "f %d\n", ops[i].id);
+        else
+            fprintf(out, "%c %d %u\n", ops[i].type, ops[i].id, ops[i].size);
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "gentrace: %s: write failed\n", argv[optind]);
+        exit(1);
+    }
+
+    printf("%s: %lu ops, %d ids, peak %llu bytes allocated\n",
+           argv[optind], num_ops, num_ids, peak_bytes);
+    return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ * heapmap - draw a heap map dump written by mdriver -H (see heapmap.h)
+ *     as a PPM or SVG image
+ *
+ * usage: heapmap [-t <trace>] [-w <width>] [-h <height>] <in.map> <out.ppm|out.svg>
+ *
+ * Each frame of one trace (the first, unless -t picks another) is a
+ * column, left to right in op order. A column stacks the frame's
+ * chunks, slabs and huge mappings in address order from the bottom,
+ * without the gaps between them, so its height is the heap's mapped
+ * size at that op on one scale for the whole trace. Allocated bytes are blue, free bytes
+ * orange and chunk bookkeeping gray; a pixel covering several blocks
+ * mixes their colors by bytes. Free space that is orange in bands
+ * between blue is external fragmentation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heapmap.h"
+
+typedef struct {
+    unsigned long addr;
+    size_t size, live;
+    int slab;
+    size_t first_seg, num_segs;  /* its blocks, in segs */
+} item_t;
+
+typedef struct {
+    int opnum;
+    size_t first_item, num_items;
+    size_t mapped;
+} frame_t;
+
+typedef struct {
+    unsigned char r, g, b;
+} color_t;
+
+static const color_t live_color = {33, 102, 172};
+static const color_t free_color = {239, 138, 98};
+static const color_t bookkeeping_color = {150, 150, 150};
+static const color_t unmapped_color = {255, 255, 255};
+
+static item_t *items;
+static size_t num_items, max_items;
+static long *segs;              /* block sizes in bytes, negative if free */
+static size_t num_segs, max_segs;
+static frame_t *frames;
+static size_t num_frames, max_frames;
+
+static void die(char *msg, char *path)
+{
+    fprintf(stderr, "heapmap: %s: %s\n", path, msg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "heapmap: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+#define GROW(array, num, max) \
+    do { \
+        if ((num) == (max)) { \
+            (max) = (max) ? 2 * (max) : 1024; \
+            (array) = xrealloc((array), (max) * sizeof(*(array))); \
+        } \
+    } while (0)
+
+static int compare_addr(const void *a, const void *b)
+{
+    unsigned long x = ((const item_t *)a)->addr, y = ((const item_t *)b)->addr;
+
+    return (x > y) - (x < y);
+}
+
+/* Read the frames of trace `want`, or of the first trace if it is -1 */
+static void read_map(char *path, int want)
+{
+    FILE *in;
+    char *line = NULL, *p, *end, magic[16];
+    size_t cap = 0;
+    int unit, tracenum, ops, in_trace = 0, found = 0;
+    frame_t *f = NULL;
+    item_t *it;
+    long units;
+
+    if ((in = fopen(path, "r")) == NULL)
+        die("cannot open", path);
+    if (fscanf(in, "%15s %d\n", magic, &unit) != 2 || strcmp(magic, HEAPMAP_MAGIC) != 0)
+        die("not a heap map", path);
+
+    while (getline(&line, &cap, in) > 0) {
+        switch (line[0]) {
+        case 't':
+            if (sscanf(line, "t %d %d", &tracenum, &ops) != 2)
+                die("bad trace line", path);
+            if (found)
+                in_trace = 0;
+            else if (want < 0 || tracenum == want)
+                in_trace = found = 1;
+            break;
+
+        case 'f':
+            if (!in_trace)
+                break;
+            GROW(frames, num_frames, max_frames);
+            f = &frames[num_frames++];
+            f->opnum = atoi(line + 2);
+            f->first_item = num_items;
+            f->num_items = 0;
+            f->mapped = 0;
+            break;
+
+        case 'c':
+        case 'h':
+        case 's':
+            if (!in_trace)
+                break;
+            if (f == NULL)
+                die("chunk outside a frame", path);
+            GROW(items, num_items, max_items);
+            it = &items[num_items++];
+            if (sscanf(line + 2, "%lx %zu %zu", &it->addr, &it->size, &it->live) != 3)
+                die("bad chunk, slab or huge line", path);
+            it->slab = (line[0] == 's');
+            it->first_seg = num_segs;
+            it->num_segs = 0;
+            f->num_items++;
+            f->mapped += it->size;
+            break;
+
+        case 'b':
+            if (!in_trace)
+                break;
+            if (num_items == 0 || items[num_items - 1].slab)
+                die("blocks outside a chunk", path);
+            it = &items[num_items - 1];
+            for (p = line + 1; (units = strtol(p, &end, 10)), end != p; p = end) {
+                GROW(segs, num_segs, max_segs);
+                segs[num_segs++] = units * unit;
+                it->num_segs++;
+            }
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+
+    if (!found)
+        die("no such trace", path);
+    if (num_frames == 0)
+        die("no frames", path);
+}
+
+/* Bytes of each kind that fall in one pixel row */
+typedef struct {
+    size_t live, free, bookkeeping;
+} row_t;
+
+static void add_span(row_t *rows, int height, size_t bpr, size_t *pos,
+                     size_t bytes, int kind)
+{
+    size_t start = *pos, end = start + bytes, row_end, take;
+    size_t r;
+
+    *pos = end;
+    while (start < end) {
+        r = start / bpr;
+        if (r >= (size_t)height)
+            return;
+        row_end = (r + 1) * bpr;
+        take = (end < row_end ? end : row_end) - start;
+        if (kind == 0)
+            rows[r].live += take;
+        else if (kind == 1)
+            rows[r].free += take;
+        else
+            rows[r].bookkeeping += take;
+        start += take;
+    }
+}
+
+/* Lay out frame f in rows[0..height-1], from the lowest address up */
+static void fill_rows(frame_t *f, row_t *rows, int height, size_t bpr)
+{
+    item_t *it;
+    size_t i, j, in_blocks, pos = 0;
+    long s;
+
+    memset(rows, 0, height * sizeof(row_t));
+    qsort(&items[f->first_item], f->num_items, sizeof(item_t), compare_addr);
+    for (i = 0; i < f->num_items; i++) {
+        it = &items[f->first_item + i];
+        if (it->slab) {
+            add_span(rows, height, bpr, &pos, it->live, 0);
+            add_span(rows, height, bpr, &pos, it->size - it->live, 1);
+            continue;
+        }
+        for (j = 0, in_blocks = 0; j < it->num_segs; j++)
+            in_blocks += labs(segs[it->first_seg + j]);
+        if (in_blocks < it->size)
+            add_span(rows, height, bpr, &pos, it->size - in_blocks, 2);
+        for (j = 0; j < it->num_segs; j++) {
+            s = segs[it->first_seg + j];
+            add_span(rows, height, bpr, &pos, labs(s), s > 0 ? 0 : 1);
+        }
+    }
+}
+
+static color_t mix(row_t *row, size_t bpr)
+{
+    double unmapped = (double)bpr - row->live - row->free - row->bookkeeping;
+    color_t c;
+
+#define CHANNEL(ch) \
+    (unsigned char)((row->live * live_color.ch + row->free * free_color.ch \
+                     + row->bookkeeping * bookkeeping_color.ch \
+                     + unmapped * unmapped_color.ch) / bpr + 0.5)
+    c.r = CHANNEL(r);
+    c.g = CHANNEL(g);
+    c.b = CHANNEL(b);
+#undef CHANNEL
+    return c;
+}
+
+int main(int argc, char **argv)
+{
+    int c, want = -1, width = 800, height = 400, colw, svg, x, y, y0;
+    size_t i, max_mapped = 0, bpr;
+    row_t *rows;
+    color_t *pixels, p;
+    char *in_path, *out_path, *dot;
+    FILE *out;
+
+    while ((c = getopt(argc, argv, "t:w:h:")) != EOF) {
+        switch (c) {
+        case 't':
+            want = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: heapmap [-t <trace>] [-w <width>] [-h <height>] "
+                    "<in.map> <out.ppm|out.svg>\n");
+            exit(1);
+        }
+    }
+    if (argc - optind != 2 || width < 1 || height < 1) {
+        fprintf(stderr, "usage: heapmap [-t <trace>] [-w <width>] [-h <height>] "
+                "<in.map> <out.ppm|out.svg>\n");
+        exit(1);
+    }
+    in_path = argv[optind];
+    out_path = argv[optind + 1];
+    svg = ((dot = strrchr(out_path, '.')) != NULL && strcmp(dot, ".svg") == 0);
+
+    read_map(in_path, want);
+    for (i = 0; i < num_frames; i++)
+        if (frames[i].mapped > max_mapped)
+            max_mapped = frames[i].mapped;
+    bpr = (max_mapped + height - 1) / height;  /* bytes per row */
+    if (bpr == 0)
+        bpr = 1;
+    colw = (width / (int)num_frames > 0) ? width / (int)num_frames : 1;
+    width = colw * num_frames;
+
+    rows = xrealloc(NULL, height * sizeof(row_t));
+    pixels = xrealloc(NULL, (size_t)width * height * sizeof(color_t));
+    for (i = 0; i < num_frames; i++) {
+        fill_rows(&frames[i], rows, height, bpr);
+        for (y = 0; y < height; y++) {
+            p = mix(&rows[y], bpr);
+            for (x = i * colw; x < (int)(i + 1) * colw; x++)
+                pixels[(size_t)(height - 1 - y) * width + x] = p;
+        }
+    }
+
+    if ((out = fopen(out_path, svg ? "w" : "wb")) == NULL)
+        die("cannot create", out_path);
+    if (svg) {
+        /* One rect per run of equal pixels in a column */
+        fprintf(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+                "shape-rendering=\"crispEdges\">\n", width, height);
+        fprintf(out, "<rect width=\"%d\" height=\"%d\" fill=\"#ffffff\"/>\n", width, height);
+        for (i = 0; i < num_frames; i++) {
+            x = i * colw;
+            for (y0 = 0; y0 < height; y0 = y) {
+                p = pixels[(size_t)y0 * width + x];
+                for (y = y0 + 1; y < height; y++)
+                    if (memcmp(&pixels[(size_t)y * width + x], &p, sizeof(p)) != 0)
+                        break;
+                if (p.r == 255 && p.g == 255 && p.b == 255)
+                    continue;
+                fprintf(out, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+                        "fill=\"#%02x%02x%02x\"/>\n", x, y0, colw, y - y0, p.r, p.g, p.b);
+            }
+        }
+        fprintf(out, "</svg>\n");
+    } else {
+        fprintf(out, "P6\n%d %d\n255\n", width, height);
+        fwrite(pixels, sizeof(color_t), (size_t)width * height, out);
+    }
+    if (fclose(out) != 0)
+        die("write failed", out_path);
+
+    printf("%zu frames, ops %d to %d; mapped up to %zu bytes, %zu bytes per row\n",
+           num_frames, frames[0].opnum, frames[num_frames - 1].opnum, max_mapped, bpr);
+
+    free(rows);
+    free(pixels);
+    return 0;
+}
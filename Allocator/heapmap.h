@@ -0,0 +1,32 @@
+/*
+ * heapmap.h - the heap map dumps written by mdriver -H and drawn by
+ *     heapmap (see heapmap.c)
+ *
+ * A dump is text. Its first line is HEAPMAP_MAGIC followed by the unit,
+ * in bytes, of block sizes. Then, for each trace replayed, a line
+ *
+ *   t <tracenum> <ops>
+ *
+ * is followed by frames, each a snapshot of the heap after some op:
+ *
+ *   f <opnum>
+ *   c <addr> <size> <live>     a chunk: its address in hex, mapped
+ *   b <units> <units> ...      bytes and allocated bytes, then its
+ *                              blocks in address order, in units,
+ *                              negative for free blocks
+ *   s <addr> <size> <live>     a slab page
+ *   h <addr> <size> <live>     a huge block's mapping, followed by a
+ *   b <units>                  b line like a chunk's with its block
+ *
+ * The bytes of a chunk that are in none of its blocks are its header,
+ * prologue and epilogue, and those of a huge mapping its list links.
+ */
+#ifndef __HEAPMAP_H_
+#define __HEAPMAP_H_
+
+#define HEAPMAP_MAGIC "mmheap1"
+
+/* Frames written for each trace, at most */
+#define HEAPMAP_FRAMES 200
+
+#endif /* __HEAPMAP_H_ */
@@ -0,0 +1,192 @@
+/*
+ * latency.c - per-request latency measurement for mdriver -L
+ *
+ * On x86-64 with an invariant time stamp counter, lat_now reads it
+ * with rdtsc, fenced so that the read is not reordered with the
+ * request being timed, and lat_init calibrates it against
+ * CLOCK_MONOTONIC_RAW. Elsewhere lat_now reads CLOCK_MONOTONIC_RAW in
+ * nanoseconds. Either way lat_init also measures the cost of reading
+ * the clock, which lat_record takes off every sample.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#include "latency.h"
+
+#define CALIBRATE_NS 20000000  /* time to calibrate the TSC against */
+
+static int use_tsc;
+static double ticks_per_ns = 1.0;
+static unsigned long long overhead; /* ticks to read the clock */
+static char clock_name[64];
+
+/* 95% two-sided critical values of Student's t for 1..30 degrees of freedom */
+static const double t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static unsigned long long raw_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+unsigned long long lat_now(void)
+{
+#if defined(__x86_64__)
+    unsigned long long t;
+
+    if (use_tsc) {
+        _mm_lfence();
+        t = __rdtsc();
+        _mm_lfence();
+        return t;
+    }
+#endif
+    return raw_ns();
+}
+
+double lat_ns(unsigned long long ticks)
+{
+    return ticks / ticks_per_ns;
+}
+
+static void calibrate(void)
+{
+#if defined(__x86_64__)
+    unsigned a, b, c, d;
+    unsigned long long ns0, ns1, t0, t1;
+
+    /* Without an invariant TSC the tick rate follows the clock speed */
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8)))
+        return;
+
+    use_tsc = 1;
+    ns0 = raw_ns();
+    t0 = lat_now();
+    while ((ns1 = raw_ns()) - ns0 < CALIBRATE_NS)
+        ;
+    t1 = lat_now();
+    ticks_per_ns = (double)(t1 - t0) / (ns1 - ns0);
+#endif
+}
+
+int lat_init(void)
+{
+    cpu_set_t set;
+    unsigned long long t0, t1, min = ~0ULL;
+    int i, cpu = sched_getcpu();
+
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            cpu = -1;
+    }
+
+    calibrate();
+    if (use_tsc)
+        snprintf(clock_name, sizeof(clock_name), "rdtsc at %.2f GHz", ticks_per_ns);
+    else
+        snprintf(clock_name, sizeof(clock_name), "CLOCK_MONOTONIC_RAW");
+
+    /* The cheapest of many back-to-back reads is the clock's own cost */
+    for (i = 0; i < 10000; i++) {
+        t0 = lat_now();
+        t1 = lat_now();
+        if (t1 - t0 < min)
+            min = t1 - t0;
+    }
+    overhead = min;
+    return cpu;
+}
+
+const char *lat_clock_name(void)
+{
+    return clock_name;
+}
+
+static int bucket(unsigned long long v)
+{
+    int e;
+
+    if (v < LAT_LINEAR)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    if (e >= 40)
+        return LAT_BUCKETS - 1;
+    return LAT_LINEAR + (e - LAT_SUB_BITS - 1) * (1 << LAT_SUB_BITS)
+        + ((v >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* The middle of the range of values in bucket i */
+static double bucket_value(int i)
+{
+    int e, sub;
+
+    if (i < LAT_LINEAR)
+        return i;
+    e = (i - LAT_LINEAR) / (1 << LAT_SUB_BITS) + LAT_SUB_BITS + 1;
+    sub = (i - LAT_LINEAR) % (1 << LAT_SUB_BITS);
+    return (double)((1ULL << LAT_SUB_BITS) + sub) * (1ULL << (e - LAT_SUB_BITS))
+        + (1ULL << (e - LAT_SUB_BITS)) / 2.0;
+}
+
+void lat_record(lat_hist_t *h, unsigned long long start, unsigned long long end)
+{
+    unsigned long long v = end - start;
+
+    v = (v > overhead) ? v - overhead : 0;
+    h->counts[bucket(v)]++;
+    h->n++;
+    if (v > h->max)
+        h->max = v;
+}
+
+double lat_quantile(lat_hist_t *h, double q)
+{
+    unsigned long target = ceil(q * h->n), seen = 0;
+    double v;
+    int i;
+
+    if (h->n == 0)
+        return 0;
+    if (target == 0)
+        target = 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target)
+            break;
+    }
+    v = bucket_value(i);
+    if (v > h->max)
+        v = h->max;
+    return lat_ns(v);
+}
+
+void lat_interval(double *x, int n, double *mean, double *half)
+{
+    double sum = 0, var = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        sum += x[i];
+    *mean = sum / n;
+    *half = 0;
+    if (n < 2)
+        return;
+    for (i = 0; i < n; i++)
+        var += (x[i] - *mean) * (x[i] - *mean);
+    var /= n - 1;
+    *half = ((n - 1 <= 30) ? t95[n - 2] : 1.960) * sqrt(var / n);
+}
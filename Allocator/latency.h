@@ -0,0 +1,46 @@
+/*
+ * latency.h - per-request latency measurement for mdriver -L
+ *
+ * Latencies are read in ticks of the fastest clock available (the time
+ * stamp counter where it is invariant, CLOCK_MONOTONIC_RAW otherwise),
+ * have the cost of reading the clock taken off, and are kept in
+ * log-linear histograms, so a trace of any length needs the same
+ * memory. Percentiles are accurate to about 3%; the maximum is exact.
+ */
+#ifndef __LATENCY_H_
+#define __LATENCY_H_
+
+#define LAT_SUB_BITS 5                     /* 32 buckets per power of two */
+#define LAT_LINEAR   (2 << LAT_SUB_BITS)   /* values kept exactly */
+#define LAT_BUCKETS  (LAT_LINEAR + (40 - LAT_SUB_BITS - 1) * (1 << LAT_SUB_BITS))
+
+typedef struct {
+    unsigned long counts[LAT_BUCKETS];
+    unsigned long n;
+    unsigned long long max;
+} lat_hist_t;
+
+/* Pin the process to the CPU it is running on and calibrate the
+   clock; returns that CPU, or -1 if the process could not be pinned */
+int lat_init(void);
+
+/* Describes the clock lat_now reads, e.g. "rdtsc at 2.90 GHz" */
+const char *lat_clock_name(void);
+
+/* Read the clock, in ticks */
+unsigned long long lat_now(void);
+
+/* Convert ticks to nanoseconds */
+double lat_ns(unsigned long long ticks);
+
+/* Add the time between start and end, less the clock's cost, to h */
+void lat_record(lat_hist_t *h, unsigned long long start, unsigned long long end);
+
+/* The latency in ns that a fraction q (0 < q <= 1) of h is no more than */
+double lat_quantile(lat_hist_t *h, double q);
+
+/* Mean of x[0..n-1] and the half width of its 95% confidence interval,
+   using Student's t distribution */
+void lat_interval(double *x, int n, double *mean, double *half);
+
+#endif /* __LATENCY_H_ */
@@ -0,0 +1,143 @@
+/*
+ * libmm.c - the mm allocator as a drop-in replacement for malloc
+ *
+ *   unix> LD_PRELOAD=./libmm.so ../Server/friendlist 8090
+ *
+ * libmm.so links this with the thread-safe build of mm.c and with a
+ * memlib built with -DMEM_UNCHECKED, which maps memory without the
+ * driver's checks and returns NULL rather than aborting when mmap
+ * fails. mm_init runs on the first call, so MM_FIT works here too.
+ *
+ * Every pointer passed to free or realloc must come from this
+ * allocator, which holds as long as the library is preloaded: the
+ * dynamic linker's own startup allocations are never freed.
+ *
+ * Each entry point passes its own caller to mm as the callsite, so
+ * that sampled callsites are in the program rather than in here.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+
+/* Everything else in libmm.so is built with -fvisibility=hidden */
+#define EXPORT __attribute__((visibility("default")))
+
+#define CALLER __builtin_return_address(0)
+
+/* mm rounds sizes up without checking for overflow, so larger
+   requests, which could never be met anyway, fail here */
+#define MAX_REQUEST (PTRDIFF_MAX / 2)
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init(void)
+{
+    if (mm_init() < 0)
+        abort();
+}
+
+static void *out_of_memory(void *p)
+{
+    if (p == NULL)
+        errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    if (size > MAX_REQUEST)
+        return out_of_memory(NULL);
+    pthread_once(&init_once, init);
+    return out_of_memory(mm_malloc_at(size, CALLER));
+}
+
+EXPORT void free(void *p)
+{
+    if (p != NULL)
+        mm_free(p);
+}
+
+EXPORT void *calloc(size_t n, size_t size)
+{
+    void *p;
+
+    if (size != 0 && n > MAX_REQUEST / size)
+        return out_of_memory(NULL);
+    // Not malloc: gcc turns malloc followed by memset into calloc
+    pthread_once(&init_once, init);
+    if ((p = mm_malloc_at(n * size, CALLER)) != NULL)
+        memset(p, 0, n * size);
+    return out_of_memory(p);
+}
+
+EXPORT void *realloc(void *p, size_t size)
+{
+    if (size > MAX_REQUEST)
+        return out_of_memory(NULL);
+    pthread_once(&init_once, init);
+    if (p != NULL && size == 0)
+        return mm_realloc_at(p, 0, CALLER);
+    return out_of_memory(mm_realloc_at(p, size, CALLER));
+}
+
+/* memalign for a caller at site */
+static void *memalign_at(size_t alignment, size_t size, void *site)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size > MAX_REQUEST || alignment > MAX_REQUEST)
+        return out_of_memory(NULL);
+    pthread_once(&init_once, init);
+    return out_of_memory(mm_memalign_at(alignment, size, site));
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    return memalign_at(alignment, size, CALLER);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign_at(alignment, size, CALLER);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if (size > MAX_REQUEST || alignment > MAX_REQUEST)
+        return ENOMEM;
+    pthread_once(&init_once, init);
+    if ((p = mm_memalign_at(alignment, size, CALLER)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign_at(sysconf(_SC_PAGESIZE), size, CALLER);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return memalign_at(page, (size + page - 1) & ~(page - 1), CALLER);
+}
+
+EXPORT size_t malloc_usable_size(void *p)
+{
+    return (p != NULL) ? mm_usable_size(p) : 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * mallocbench.c - smoke test and benchmark for whatever malloc the
+ *     program runs with
+ *
+ *   unix> mallocbench [-t <threads>] [-n <ops per thread>]
+ *   unix> LD_PRELOAD=./libmm.so mallocbench
+ *
+ * Each thread keeps SLOTS blocks and, at every step, frees, reallocates
+ * or refills a random one. Most sizes are small, some are a few
+ * kilobytes and a few are past mm's huge-block limit; some blocks come
+ * from calloc and posix_memalign. A block's first word holds its size
+ * and its last byte a tag derived from it, and both are checked before
+ * the block is reallocated or freed, so a block handed out twice shows
+ * up as a mismatch. Some blocks are swapped through a shared array and
+ * freed by another thread, and the main thread forks while the workers
+ * run to check that a child can still allocate.
+ *
+ * Prints throughput, peak RSS and the RSS left once every block is
+ * freed, and cycles and dTLB misses per op where hardware counters are
+ * available (see perfctr.h). Exits with status 1 if a check or a child
+ * failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "perfctr.h"
+
+#define SLOTS 1024
+#define EXCHANGE 256
+#define FORKS 20
+
+static int num_threads = 4;
+static long ops_per_thread = 1000000;
+
+static void *exchange[EXCHANGE];
+static volatile int failed;
+
+typedef struct {
+    unsigned long long rng;
+    void *slots[SLOTS];
+} worker_t;
+
+static unsigned long long next_rand(worker_t *w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static size_t pick_size(worker_t *w)
+{
+    unsigned r = next_rand(w) % 100;
+
+    if (r < 80)
+        return 16 + next_rand(w) % 241;
+    if (r < 98)
+        return 257 + next_rand(w) % 7936;
+    return 65536 + next_rand(w) % 196608;
+}
+
+static unsigned char tag(size_t size)
+{
+    return (size * 131) >> 3;
+}
+
+static void fill(void *p, size_t size)
+{
+    *(size_t *)p = size;
+    ((unsigned char *)p)[size - 1] = tag(size);
+}
+
+static size_t check(void *p)
+{
+    size_t size = *(size_t *)p;
+
+    if (size < 16 || size > 65536 + 196608 || ((unsigned char *)p)[size - 1] != tag(size)) {
+        fprintf(stderr, "mallocbench: block %p is corrupted\n", p);
+        failed = 1;
+        return 0;
+    }
+    return size;
+}
+
+static void *new_block(worker_t *w)
+{
+    size_t size = pick_size(w);
+    unsigned r = next_rand(w) % 16;
+    void *p = NULL;
+
+    if (r == 0)
+        p = calloc(1, size);
+    else if (r == 1) {
+        if (posix_memalign(&p, 64, size) != 0)
+            p = NULL;
+    } else
+        p = malloc(size);
+
+    if (p == NULL || (r == 1 && ((size_t)p & 63) != 0)) {
+        fprintf(stderr, "mallocbench: allocation of %zu bytes failed\n", size);
+        failed = 1;
+        exit(1);
+    }
+    fill(p, size);
+    return p;
+}
+
+static void *run(void *arg)
+{
+    worker_t *w = arg;
+    long i;
+    int k;
+    void *p, *q;
+    size_t size;
+
+    for (i = 0; i < ops_per_thread; i++) {
+        k = next_rand(w) % SLOTS;
+        p = w->slots[k];
+
+        if (p == NULL) {
+            w->slots[k] = new_block(w);
+            continue;
+        }
+
+        switch (next_rand(w) % 8) {
+        case 0:
+            if ((size = check(p)) == 0)
+                break;
+            q = realloc(p, (size = pick_size(w)));
+            if (q == NULL) {
+                failed = 1;
+                break;
+            }
+            fill(q, size);
+            w->slots[k] = q;
+            break;
+        case 1:
+            p = __atomic_exchange_n(&exchange[next_rand(w) % EXCHANGE], p, __ATOMIC_ACQ_REL);
+            w->slots[k] = NULL;
+            if (p != NULL && check(p) != 0)
+                free(p);
+            break;
+        default:
+            if (check(p) != 0)
+                free(p);
+            w->slots[k] = NULL;
+            break;
+        }
+    }
+
+    for (k = 0; k < SLOTS; k++)
+        if (w->slots[k] != NULL && check(w->slots[k]) != 0)
+            free(w->slots[k]);
+    return NULL;
+}
+
+/* A child runs alone with whatever state the fork caught, so any lock
+   it inherited held would hang it; the alarm turns that into a failure */
+static int fork_and_allocate(void)
+{
+    pid_t pid;
+    int status, i;
+    void *p[256];
+
+    if ((pid = fork()) == 0) {
+        alarm(10);
+        for (i = 0; i < 256; i++)
+            if ((p[i] = malloc(16 + i * 64)) == NULL)
+                _exit(1);
+        for (i = 0; i < 256; i++)
+            free(p[i]);
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Resident set size now, in bytes */
+static double current_rss(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, resident = 0;
+
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *tids;
+    worker_t *workers;
+    struct timespec start, end;
+    struct rusage usage;
+    double secs, ops, counts[PC_EVENTS];
+    int c, i, forks_ok = 0, counting;
+
+    while ((c = getopt(argc, argv, "t:n:")) != EOF) {
+        switch (c) {
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'n':
+            ops_per_thread = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t <threads>] [-n <ops per thread>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (num_threads < 1 || ops_per_thread < 1) {
+        fprintf(stderr, "mallocbench: need at least one thread and one op\n");
+        exit(1);
+    }
+
+    tids = malloc(num_threads * sizeof(pthread_t));
+    workers = calloc(num_threads, sizeof(worker_t));
+    if (tids == NULL || workers == NULL) {
+        fprintf(stderr, "mallocbench: out of memory\n");
+        exit(1);
+    }
+
+    if ((counting = perfctr_init() > 0))
+        perfctr_start();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num_threads; i++) {
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        pthread_create(&tids[i], NULL, run, &workers[i]);
+    }
+    for (i = 0; i < FORKS; i++) {
+        forks_ok += fork_and_allocate();
+        usleep(5000);
+    }
+    for (i = 0; i < num_threads; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (counting)
+        perfctr_stop(counts);
+
+    for (i = 0; i < EXCHANGE; i++)
+        if (exchange[i] != NULL && check(exchange[i]) != 0)
+            free(exchange[i]);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    ops = (double)num_threads * ops_per_thread;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%d threads x %ld ops: %.2f Mops/sec, peak RSS %.1f MB, "
+           "final RSS %.1f MB, %d/%d forks ok\n",
+           num_threads, ops_per_thread, ops / secs / 1e6, usage.ru_maxrss / 1024.0,
+           current_rss() / (1 << 20), forks_ok, FORKS);
+    if (counting && counts[PC_CYCLES] >= 0 && counts[PC_DTLB_MISSES] >= 0)
+        printf("per op: %.0f cycles, %.3f dTLB misses\n",
+               counts[PC_CYCLES] / ops, counts[PC_DTLB_MISSES] / ops);
+
+    free(tids);
+    free(workers);
+    return (failed || forks_ok != FORKS) ? 1 : 0;
+}
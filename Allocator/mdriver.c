@@ -17,12 +17,23 @@
 #include <math.h>
 #include <inttypes.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "pagemap.h"
 #include "fsecs.h"
 #include "config.h"
+#include "tracefmt.h"
+#include "latency.h"
+#include "perfctr.h"
+#include "heapmap.h"
 
 /**********************
  * Constants and macros
@@ -33,6 +44,21 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Most threads that -T will replay a trace on */
+#define MAX_THREADS   64
+
+/* Blocks each replay thread allocates for its neighbor to free */
+#define HANDOFF      256
+
+/* With -S, about one mm_malloc call per SAMPLE_PERIOD bytes is sampled */
+#define SAMPLE_PERIOD 4096
+
+/* With -L, untimed replays of a trace before it is measured */
+#define LAT_WARMUP    3
+
+/* Most levels of the range skip list: enough for 2^RANGE_LEVELS blocks */
+#define RANGE_LEVELS  24
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
@@ -40,27 +66,41 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The ranges of a trace are
+ * kept in a skip list sorted by lo, whose head is a range_t with
+ * RANGE_LEVELS levels and no extent.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    int levels;            /* number of lists the record is on */
+    struct range_t *next[1]; /* next record on each of those lists */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC = TRACE_ALLOC, FREE = TRACE_FREE, REALLOC = TRACE_REALLOC}
+        type;                         /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
 } traceop_t;
 
-/* Holds the information for one trace file*/
+/* 
+ * Holds the information for one trace file. The requests are kept
+ * encoded as in a binary trace file (see tracefmt.h) and decoded one
+ * at a time by next_op. A binary trace file is mapped rather than
+ * read, so a trace does not have to fit in memory.
+ */
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    const unsigned char *ops;     /* encoded requests... */
+    const unsigned char *ops_end; /* ... up to here */
+    void *map;           /* mapping of a binary trace file, or NULL... */
+    size_t map_size;     /* ... and its size */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
@@ -75,6 +115,28 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+#ifdef MM_THREADS
+/* 
+ * Holds the params to eval_mm_threads, which replays one trace on
+ * nthreads threads at once, each with its own copy of the blocks array.
+ */
+typedef struct {
+    trace_t *trace;
+    int nthreads;
+    int bad;                  /* blocks found clobbered or misowned */
+    pthread_barrier_t handoff;
+} threads_t;
+
+/* One replay thread; its handoff blocks are freed by its neighbor */
+typedef struct {
+    threads_t *threads;
+    int id;
+    char *handoff[HANDOFF];
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -90,12 +152,36 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a -j worker process sends back after evaluating its trace */
+typedef struct {
+    stats_t stats;
+    int errors;          /* errors the worker found */
+    size_t pagemap_peak; /* its pagemap_peak_footprint() */
+} job_result_t;
+
+/* A running -j worker */
+typedef struct {
+    pid_t pid;           /* 0 if the slot is free */
+    int fd;              /* read end of the worker's pipe */
+    int tracenum;
+} job_t;
+
+/* Evaluates one trace for libc or mm malloc */
+typedef void (*eval_trace_t)(char *tracefile, int tracenum, stats_t *stats);
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
+static FILE *stats_file = NULL; /* if set, heap stats are dumped here (-S) */
+
+/* eval_mm_util's requests are sampled as coming from these sites rather
+   than from its own code, so that the -S dump can name them */
+static char alloc_site, realloc_site;
+static FILE *heap_file = NULL;  /* if set, heap maps are dumped here (-H) */
+static size_t jobs_pagemap_peak = 0; /* largest pagemap of any -j worker */
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -110,14 +196,20 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range skip lists */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
+static range_t *new_range(char *lo, char *hi, int levels);
+static int random_levels(void);
+static void find_range(range_t *head, char *lo, range_t **update);
 static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static trace_t *map_trace(char *path, int fd);
+static const unsigned char *next_op(trace_t *trace, const unsigned char *pos,
+                                    traceop_t *op);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -129,8 +221,23 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_requests(trace_t *trace, lat_hist_t *hists);
+static void eval_mm_latency(char **tracefiles, int num_tracefiles,
+			    stats_t *stats, int runs);
+static void eval_mm_counters(char **tracefiles, int num_tracefiles,
+			     stats_t *stats);
+static void dump_stats(int opnum);
+static void dump_sites(void);
+static void dump_heap(int opnum);
+static void eval_mm_scaling(char **tracefiles, int num_tracefiles,
+			    int max_threads);
 
 /* Various helper routines */
+static void eval_libc_trace(char *tracefile, int tracenum, stats_t *stats);
+static void eval_mm_trace(char *tracefile, int tracenum, stats_t *stats);
+static void eval_traces(eval_trace_t eval, char **tracefiles, int num_tracefiles,
+                        stats_t *stats, int jobs);
+
 static void printresults(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
@@ -146,14 +253,16 @@ int main(int argc, char **argv)
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    size_t pagemap_peak;       /* largest pagemap of any trace */
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int max_threads = 0; /* If set, replay traces on 1..max_threads threads (-T) */
+    int jobs = 1;        /* Traces evaluated at once, each in its own process (-j) */
+    int lat_runs = 0;    /* If set, measure request latency over this many runs (-L) */
+    int counters = 0;    /* If set, count hardware events per request (-P) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, inst_util, avg_mm_inst_util, avg_mm_util, avg_mm_throughput;
@@ -163,7 +272,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalj:L:PT:S:H:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -186,6 +295,41 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'j': /* Evaluate up to j traces at once */
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "mdriver: -j must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'L': /* Measure request latency over L runs */
+            lat_runs = atoi(optarg);
+            if (lat_runs < 2) {
+                fprintf(stderr, "mdriver: -L must be at least 2\n");
+                exit(1);
+            }
+            break;
+        case 'P': /* Count hardware events */
+            counters = 1;
+            break;
+        case 'T': /* Measure scaling from 1 to T threads */
+            max_threads = atoi(optarg);
+            if (max_threads < 1 || max_threads > MAX_THREADS) {
+                fprintf(stderr, "mdriver: -T must be between 1 and %d\n",
+                        MAX_THREADS);
+                exit(1);
+            }
+            break;
+        case 'S': /* Dump heap stats after every op of the util pass */
+            if ((stats_file = fopen(optarg, "w")) == NULL)
+                unix_error("ERROR: cannot open stats file");
+            mm_sample_sites(SAMPLE_PERIOD);
+            break;
+        case 'H': /* Dump heap maps during the util pass */
+            if ((heap_file = fopen(optarg, "w")) == NULL)
+                unix_error("ERROR: cannot open heap map file");
+            fprintf(heap_file, "%s %d\n", HEAPMAP_MAGIC, ALIGNMENT);
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -201,6 +345,12 @@ int main(int argc, char **argv)
         }
     }
 	
+    /* Workers would all write to the one stats or heap map file at once */
+    if (jobs > 1 && (stats_file != NULL || heap_file != NULL)) {
+        fprintf(stderr, "mdriver: -S and -H cannot be used with -j\n");
+        exit(1);
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -227,20 +377,7 @@ int main(int argc, char **argv)
 	    unix_error("libc_stats calloc in main failed");
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
-	for (i=0; i < num_tracefiles; i++) {
-	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
-	    if (verbose > 1)
-		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
-		speed_params.trace = trace;
-		if (verbose > 1)
-		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-	    }
-	    free_trace(trace);
-	}
+	eval_traces(eval_libc_trace, tracefiles, num_tracefiles, libc_stats, jobs);
 
 	/* Display the libc results in a compact table */
 	if (verbose) {
@@ -264,32 +401,30 @@ int main(int argc, char **argv)
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i].inst_util);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    eval_traces(eval_mm_trace, tracefiles, num_tracefiles, mm_stats, jobs);
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
-	printf("\n");
+	pagemap_peak = pagemap_peak_footprint();
+	if (jobs_pagemap_peak > pagemap_peak)
+	    pagemap_peak = jobs_pagemap_peak;
+	printf("Pagemap bookkeeping at peak: %zu bytes\n\n", pagemap_peak);
     }
 
+    /* Optionally measure the latency of each mm request */
+    if (lat_runs)
+	eval_mm_latency(tracefiles, num_tracefiles, mm_stats, lat_runs);
+
+    /* Optionally count hardware events during the mm requests */
+    if (counters)
+	eval_mm_counters(tracefiles, num_tracefiles, mm_stats);
+
+    /* Optionally measure how the mm package scales with threads */
+    if (max_threads)
+	eval_mm_scaling(tracefiles, num_tracefiles, max_threads);
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -347,6 +482,144 @@ int main(int argc, char **argv)
 }
 
 
+/*
+ * eval_libc_trace - Check libc malloc on one trace and time it
+ */
+static void eval_libc_trace(char *tracefile, int tracenum, stats_t *stats)
+{
+    trace_t *trace = read_trace(tracedir, tracefile);
+    speed_t speed_params;
+
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking libc malloc for correctness, ");
+    stats->valid = eval_libc_valid(trace, tracenum);
+    if (stats->valid) {
+	speed_params.trace = trace;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_libc_speed, &speed_params);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_trace - Check mm malloc on one trace, then measure its
+ *     utilization and time it
+ */
+static void eval_mm_trace(char *tracefile, int tracenum, stats_t *stats)
+{
+    trace_t *trace = read_trace(tracedir, tracefile);
+    range_t *ranges = NULL;
+    speed_t speed_params;
+
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, &ranges, &stats->inst_util);
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+    }
+    clear_ranges(&ranges);
+    free_trace(trace);
+}
+
+/*
+ * eval_traces - Evaluate every trace with eval. With jobs > 1, each
+ *     trace is evaluated in a worker process of its own, since the
+ *     allocators keep global state, and up to jobs of them run at
+ *     once. A worker sends its stats back over a pipe; one that dies
+ *     instead marks its trace as invalid. Workers compete for the
+ *     CPUs, so their times are only comparable to a serial run when
+ *     jobs is at most the number of idle CPUs.
+ */
+static void eval_traces(eval_trace_t eval, char **tracefiles, int num_tracefiles,
+                        stats_t *stats, int jobs)
+{
+    job_t *running;
+    job_result_t result;
+    int next = 0, active = 0, i, status, fds[2];
+    pid_t pid;
+
+    if (jobs <= 1) {
+	for (i = 0; i < num_tracefiles; i++)
+	    eval(tracefiles[i], i, &stats[i]);
+	return;
+    }
+
+    if ((running = calloc(jobs, sizeof(job_t))) == NULL)
+	unix_error("running calloc in eval_traces failed");
+
+    /* Otherwise every worker would print whatever is buffered */
+    fflush(stdout);
+
+    while (next < num_tracefiles || active > 0) {
+	/* Start workers until jobs of them are running */
+	while (next < num_tracefiles && active < jobs) {
+	    if (pipe(fds) < 0)
+		unix_error("pipe failed in eval_traces");
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_traces");
+	    if (pid == 0) {
+		close(fds[0]);
+		memset(&result, 0, sizeof(result));
+		eval(tracefiles[next], next, &result.stats);
+		result.errors = errors;
+		result.pagemap_peak = pagemap_peak_footprint();
+		fflush(stdout);
+		if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+		    _exit(1);
+		_exit(0);
+	    }
+	    close(fds[1]);
+	    for (i = 0; running[i].pid != 0; i++)
+		;
+	    running[i].pid = pid;
+	    running[i].fd = fds[0];
+	    running[i].tracenum = next++;
+	    active++;
+	}
+
+	/* A worker writes its result before it exits, and the result
+	   fits in the pipe, so it is there once the worker is reaped */
+	if ((pid = waitpid(-1, &status, 0)) < 0)
+	    unix_error("waitpid failed in eval_traces");
+	for (i = 0; i < jobs && running[i].pid != pid; i++)
+	    ;
+	if (i == jobs)
+	    continue;
+
+	if (read(running[i].fd, &result, sizeof(result)) == sizeof(result)) {
+	    stats[running[i].tracenum] = result.stats;
+	    errors += result.errors;
+	    if (result.pagemap_peak > jobs_pagemap_peak)
+		jobs_pagemap_peak = result.pagemap_peak;
+	} else {
+	    errors++;
+	    stats[running[i].tracenum].valid = 0;
+	    if (WIFSIGNALED(status))
+		printf("ERROR [trace %d]: worker killed by signal %d\n",
+		       running[i].tracenum, WTERMSIG(status));
+	    else
+		printf("ERROR [trace %d]: worker exited without a result\n",
+		       running[i].tracenum);
+	}
+	close(running[i].fd);
+	running[i].pid = 0;
+	active--;
+    }
+
+    free(running);
+}
+
+
 /*****************************************************************
  * The following routines manipulate the range list, which keeps 
  * track of the extent of every allocated block payload. We use the 
@@ -363,7 +636,7 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *update[RANGE_LEVELS];
     char msg[MAXLINE];
     size_t page_size = mem_pagesize(), i;
 
@@ -393,28 +666,88 @@ static int add_range(range_t **ranges, char *lo, int size,
       return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    if (*ranges == NULL)
+        *ranges = new_range(NULL, NULL, RANGE_LEVELS);
+
+    /* 
+     * The payload must not overlap any other payloads. Those do not
+     * overlap each other, so only the payloads just below and just
+     * above lo need to be checked.
+     */
+    find_range(*ranges, lo, update);
+    p = update[0];
+    if (p == *ranges || p->hi < lo)
+        p = p->next[0];
+    if (p != NULL && p->lo <= hi) {
+        sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                lo, hi, p->lo, p->hi);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
      * by creating a range struct and adding it the range list.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = new_range(lo, hi, random_levels());
+    for (i = 0; i < p->levels; i++) {
+        p->next[i] = update[i]->next[i];
+        update[i]->next[i] = p;
+    }
+    return 1;
+}
+
+/*
+ * new_range - Allocate a range record on `levels` lists
+ */
+static range_t *new_range(char *lo, char *hi, int levels)
+{
+    range_t *p;
+    int i;
+
+    p = malloc(sizeof(range_t) + (levels - 1) * sizeof(range_t *));
+    if (p == NULL)
+	unix_error("malloc error in new_range");
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
-    return 1;
+    p->levels = levels;
+    for (i = 0; i < levels; i++)
+        p->next[i] = NULL;
+    return p;
+}
+
+/*
+ * random_levels - Pick the number of lists for a new record: i + 1
+ *     with probability 2^-(i+1). xorshift keeps runs reproducible and
+ *     leaves rand() to the rest of the driver.
+ */
+static int random_levels(void)
+{
+    static unsigned x = 2463534242u;
+    int levels = 1;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    while ((x & (1u << (levels - 1))) && levels < RANGE_LEVELS)
+        levels++;
+    return levels;
+}
+
+/*
+ * find_range - Set update[i] to the last record on list i whose
+ *     payload starts below lo (the head if there is none)
+ */
+static void find_range(range_t *head, char *lo, range_t **update)
+{
+    range_t *p = head;
+    int i;
+
+    for (i = RANGE_LEVELS - 1; i >= 0; i--) {
+        while (p->next[i] != NULL && p->next[i]->lo < lo)
+            p = p->next[i];
+        update[i] = p;
+    }
 }
 
 /* 
@@ -422,17 +755,20 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    range_t *p, *update[RANGE_LEVELS];
+    int i;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    if (*ranges == NULL)
+        return;
+
+    find_range(*ranges, lo, update);
+    p = update[0]->next[0];
+    if (p == NULL || p->lo != lo)
+        return;
+
+    for (i = 0; i < p->levels; i++)
+        update[i]->next[i] = p->next[i];
+    free(p);
 }
 
 /*
@@ -444,7 +780,7 @@ static void clear_ranges(range_t **ranges)
     range_t *pnext;
 
     for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
+        pnext = p->next[0];
         free(p);
     }
     *ranges = NULL;
@@ -464,21 +800,36 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
+    char magic[sizeof(TRACE_MAGIC) - 1];
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    unsigned char *ops;
+    size_t ops_size;
+    int fd;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
 
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+
+    /* Binary traces are mapped rather than read */
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0)
+        return map_trace(path, fd);
+
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
     /* Read the trace file header */
-    strcpy(path, tracedir);
-    strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
+    lseek(fd, 0, SEEK_SET);
+    if ((tracefile = fdopen(fd, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
@@ -487,10 +838,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fscanf(tracefile, "%d", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+    /* We'll store each request line in the trace, encoded, here */
+    if ((ops = (unsigned char *)malloc((size_t)trace->num_ops * TRACE_MAX_OP)) == NULL)
 	unix_error("malloc 2 failed in read_trace");
+    trace->map = NULL;
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -505,26 +856,23 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    ops_size = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
+	assert(op_index < trace->num_ops);
 	switch(type[0]) {
 	case 'a':
 	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
+	    ops_size += trace_encode_op(ops + ops_size, ALLOC, index, size);
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
 	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
+	    ops_size += trace_encode_op(ops + ops_size, REALLOC, index, size);
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
+	    ops_size += trace_encode_op(ops + ops_size, FREE, index, 0);
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
@@ -537,18 +885,98 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+
+    /* Give back the room that the encoding did not need */
+    if ((trace->ops = realloc(ops, ops_size ? ops_size : 1)) == NULL)
+	unix_error("realloc failed in read_trace");
+    trace->ops_end = trace->ops + ops_size;
     
     return trace;
 }
 
+/*
+ * map_trace - map a binary trace file. Its requests are read straight
+ *     from the mapping as they are replayed, so the kernel can page
+ *     them in, and drop them again, as needed.
+ */
+static trace_t *map_trace(char *path, int fd)
+{
+    trace_t *trace;
+    trace_header_t *h;
+    struct stat st;
+
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+	unix_error("malloc failed in map_trace");
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(trace_header_t)) {
+	sprintf(msg, "Truncated binary trace %s", path);
+	app_error(msg);
+    }
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    close(fd);
+    madvise(trace->map, trace->map_size, MADV_SEQUENTIAL);
+
+    h = (trace_header_t *)trace->map;
+    if (h->num_ids > INT32_MAX || h->num_ops > INT32_MAX) {
+	sprintf(msg, "Binary trace %s has too many requests", path);
+	app_error(msg);
+    }
+    trace->sugg_heapsize = h->sugg_heapsize;
+    trace->num_ids = h->num_ids;
+    trace->num_ops = h->num_ops;
+    trace->weight = h->weight;
+    trace->ops = (unsigned char *)(h + 1);
+    trace->ops_end = (unsigned char *)trace->map + trace->map_size;
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+        (trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc failed in map_trace");
+
+    return trace;
+}
+
+/*
+ * next_op - decode the request at pos into op, and return the position
+ *     of the request after it
+ */
+static const unsigned char *next_op(trace_t *trace, const unsigned char *pos,
+                                    traceop_t *op)
+{
+    unsigned index, size;
+    int type;
+
+    if (pos >= trace->ops_end)
+	app_error("Trace ends before its last request");
+    if ((pos = trace_decode_op(pos, trace->ops_end, &type, &index, &size)) == NULL)
+	app_error("Trace ends in the middle of a request");
+    if (type > TRACE_REALLOC)
+	app_error("Trace request has a bad type");
+    if (index >= trace->num_ids)
+	app_error("Trace request index is out of range");
+    if (type != TRACE_FREE && size == 0)
+	app_error("Trace request has size 0");
+    op->type = type;
+    op->index = index;
+    op->size = size;
+    return pos;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
+    if (trace->map)           /* free the requests... */
+	munmap(trace->map, trace->map_size);
+    else
+	free((void *)trace->ops);
+    free(trace->blocks);      /* ... the two arrays... */
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
@@ -563,9 +991,12 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i;
+    traceop_t op;
+    const unsigned char *pos;
+    int i, j;
     int index;
     int size;
+    int oldsize;
     char *newp;
     char *oldp;
     char *p;
@@ -580,11 +1011,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+	index = op.index;
+	size = op.size;
 
-        switch (trace->ops[i].type) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -614,12 +1046,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
-        case REALLOC: /* mm_malloc + mm_free */
+        case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
 
@@ -630,10 +1062,23 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 
+	    /* ADDED: cgw
+	     * Make sure that the new block contains the data from the old
+	     * block and then fill in the new block with the low order byte
+	     * of the new index
+	     */
+	    oldsize = trace->block_sizes[index];
+	    if (size < oldsize)
+		oldsize = size;
+	    for (j = 0; j < oldsize; j++) {
+		if ((unsigned char)newp[j] != (index & 0xFF)) {
+		    malloc_error(tracenum, i, "mm_realloc did not preserve the "
+				 "data from old block");
+		    return 0;
+		}
+	    }
 	    memset(newp, index & 0xFF, size);
 
-            mm_free(oldp);
-
 	    /* Remember region */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = size;
@@ -672,6 +1117,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio)
 {   
+    traceop_t op;
+    const unsigned char *pos;
     int i;
     int index;
     int size, newsize, oldsize;
@@ -679,6 +1126,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
     size_t heap_size = 0, total_size = 0;
     double ratio, ratio_frac, accum_ratio_frac = 1.0, accum_ratio_exp = 0.0;
     int ratio_exp;
+    int heap_period = (trace->num_ops + HEAPMAP_FRAMES - 1) / HEAPMAP_FRAMES;
     char *p;
     char *newp, *oldp;
 
@@ -686,14 +1134,23 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    if (heap_file)
+	fprintf(heap_file, "t %d %d\n", tracenum, trace->num_ops);
+
+    if (stats_file) {
+	fprintf(stats_file, "# trace %d\n", tracenum);
+	fprintf(stats_file, "# op live free mapped used chunks slabs huge frag\n");
+    }
+
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+        switch (op.type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op.index;
+	    size = op.size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm_malloc_at(size, &alloc_site)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -706,17 +1163,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 
             break;
 
-	case REALLOC: /* mm_mealloc + mm_free */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	case REALLOC: /* mm_realloc */
+	    index = op.index;
+	    newsize = op.size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_malloc(newsize)) == NULL)
+	    if ((newp = mm_realloc_at(oldp, newsize, &realloc_site)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
-            mm_free(oldp);
-
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = newsize;
@@ -728,7 +1183,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
@@ -766,8 +1221,16 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
         accum_ratio_exp += ratio_exp;
         
         // printf("%ld %ld %f\n", total_size, heap_size, ratio);
+
+        if (stats_file)
+            dump_stats(i);
+        if (heap_file && ((i + 1) % heap_period == 0 || i == trace->num_ops - 1))
+            dump_heap(i);
     }
 
+    if (stats_file)
+        dump_sites();
+
     mem_reset();
 
     ratio = accum_ratio_frac * pow(2, accum_ratio_exp / trace->num_ops);
@@ -780,12 +1243,87 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 }
 
 
+/*
+ * dump_stats - Write one line of heap stats, in bytes, to the -S file
+ */
+static void dump_stats(int opnum)
+{
+    mm_stats_t st;
+    size_t page = mem_pagesize();
+
+    mm_stats(&st);
+    fprintf(stats_file, "%d %zu %zu %zu %zu %zu %zu %zu %.4f\n", opnum,
+            st.live_bytes, st.free_bytes, st.mapped_pages * page,
+            st.used_pages * page, st.chunks, st.slabs, st.huge_blocks,
+            st.fragmentation);
+}
+
+/*
+ * dump_sites - Write the sampled mm_malloc callsites of a trace to the
+ *     -S file, as comments so that plotting skips them. A trace is
+ *     replayed from one loop, so its sites are that loop's mallocs and
+ *     the reallocs that had to move their blocks.
+ */
+static void dump_sites(void)
+{
+    mm_stats_t st;
+    char *name;
+    int i;
+
+    mm_stats(&st);
+    for (i = 0; i < st.num_sites; i++) {
+        name = (st.sites[i].site == &alloc_site) ? "alloc"
+            : (st.sites[i].site == &realloc_site) ? "realloc" : NULL;
+        if (name)
+            fprintf(stats_file, "# site %s", name);
+        else
+            fprintf(stats_file, "# site %p", st.sites[i].site);
+        fprintf(stats_file, " samples %zu bytes %zu\n",
+                st.sites[i].samples, st.sites[i].bytes);
+    }
+}
+
+/* Ends the list of blocks of the chunk that dump_heap_item last wrote */
+static int heap_blocks_open;
+
+static void dump_heap_item(const mm_walk_t *item, void *arg)
+{
+    FILE *f = arg;
+    long units = item->size / ALIGNMENT;
+
+    if (item->kind == MM_WALK_BLOCK) {
+        fprintf(f, " %ld", item->live ? units : -units);
+        return;
+    }
+    if (heap_blocks_open)
+        fprintf(f, "\n");
+    fprintf(f, "%c %lx %zu %zu\n", "cbsh"[item->kind], /* by MM_WALK_* */
+            (unsigned long)item->addr, item->size, item->live);
+    if ((heap_blocks_open = (item->kind != MM_WALK_SLAB)))
+        fprintf(f, "b");
+}
+
+/*
+ * dump_heap - Write a frame of the heap map (see heapmap.h) to the -H
+ *     file
+ */
+static void dump_heap(int opnum)
+{
+    fprintf(heap_file, "f %d\n", opnum);
+    heap_blocks_open = 0;
+    mm_walk(dump_heap_item, heap_file);
+    if (heap_blocks_open)
+        fprintf(heap_file, "\n");
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr)
 {
+    traceop_t op;
+    const unsigned char *pos;
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -795,29 +1333,29 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op.index;
+            size = op.size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
-	case REALLOC: /* mm_malloc + mm_free */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	case REALLOC: /* mm_realloc */
+	    index = op.index;
+            newsize = op.size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_malloc(newsize)) == NULL)
+            if ((newp = mm_realloc(oldp, newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
-            mm_free(oldp);
             trace->blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op.index;
             block = trace->blocks[index];
             mm_free(block);
             break;
@@ -825,10 +1363,352 @@ static void eval_mm_speed(void *ptr)
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+
+    mem_reset();
+}
+
+/*
+ * eval_mm_requests - Replay a trace like eval_mm_speed, adding the
+ *     latency of every request to the histogram for its type.
+ */
+static void eval_mm_requests(trace_t *trace, lat_hist_t *hists)
+{
+    traceop_t op;
+    const unsigned char *pos;
+    unsigned long long start;
+    int i;
+    char *p;
+
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_requests");
+
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+	start = lat_now();
+	switch (op.type) {
+	case ALLOC:
+	    p = mm_malloc(op.size);
+	    break;
+	case REALLOC:
+	    p = mm_realloc(trace->blocks[op.index], op.size);
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[op.index]);
+	    p = trace->blocks[op.index];
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_requests");
+	}
+	lat_record(&hists[op.type], start, lat_now());
+	if (p == NULL)
+	    app_error("mm_malloc or mm_realloc error in eval_mm_requests");
+	trace->blocks[op.index] = p;
+    }
 
     mem_reset();
 }
 
+/*
+ * eval_mm_latency - Measure each valid trace on one pinned CPU: after
+ *     LAT_WARMUP untimed replays, time runs whole replays for a 95%
+ *     confidence interval on Kops, then replay it runs more times
+ *     timing every request for the p50, p99 and maximum latency of
+ *     each type. Reading the clock around every request slows the
+ *     replay down, so the two sets of runs are kept apart.
+ */
+static void eval_mm_latency(char **tracefiles, int num_tracefiles,
+			    stats_t *stats, int runs)
+{
+    static char *names[] = {"malloc", "free", "realloc"};
+    lat_hist_t *hists;
+    trace_t *trace;
+    speed_t speed_params;
+    unsigned long long start;
+    double *kops, mean, half;
+    int i, r, type, cpu;
+
+    if ((hists = malloc(3 * sizeof(lat_hist_t))) == NULL ||
+	(kops = malloc(runs * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+
+    cpu = lat_init();
+    printf("Latency for mm malloc (%d warmup and 2x%d measured runs, ",
+	   LAT_WARMUP, runs);
+    if (cpu >= 0)
+	printf("pinned to CPU %d, %s):\n", cpu, lat_clock_name());
+    else
+	printf("not pinned, %s):\n", lat_clock_name());
+    printf("%5s%8s%17s%9s%9s%9s%11s\n",
+	   "trace", "op", "Kops (95% CI)", "count", "p50 ns", "p99 ns", "max ns");
+
+    for (i = 0; i < num_tracefiles; i++) {
+	if (!stats[i].valid)
+	    continue;
+	trace = read_trace(tracedir, tracefiles[i]);
+	speed_params.trace = trace;
+	speed_params.ranges = NULL;
+
+	for (r = 0; r < LAT_WARMUP; r++)
+	    eval_mm_speed(&speed_params);
+	for (r = 0; r < runs; r++) {
+	    start = lat_now();
+	    eval_mm_speed(&speed_params);
+	    kops[r] = trace->num_ops / lat_ns(lat_now() - start) * 1e6;
+	}
+	lat_interval(kops, runs, &mean, &half);
+
+	memset(hists, 0, 3 * sizeof(lat_hist_t));
+	for (r = 0; r < runs; r++)
+	    eval_mm_requests(trace, hists);
+
+	printf("%2d%11s%9.0f +-%5.0f\n", i, "all", mean, half);
+	for (type = 0; type < 3; type++)
+	    if (hists[type].n > 0)
+		printf("%13s%17s%9lu%9.0f%9.0f%11.0f\n", names[type], "",
+		       hists[type].n,
+		       lat_quantile(&hists[type], 0.50),
+		       lat_quantile(&hists[type], 0.99),
+		       lat_ns(hists[type].max));
+	free_trace(trace);
+    }
+    printf("\n");
+
+    free(hists);
+    free(kops);
+}
+
+/*
+ * eval_mm_counters - Count hardware events over one more replay of
+ *     each valid trace, after a replay to warm the caches as the
+ *     timed runs did, and print them per request next to its Kops.
+ */
+static void eval_mm_counters(char **tracefiles, int num_tracefiles,
+			     stats_t *stats)
+{
+    double counts[PC_EVENTS];
+    trace_t *trace;
+    speed_t speed_params;
+    int i, e;
+
+    if (perfctr_init() == 0)
+	return;
+
+    printf("Hardware counters for mm malloc, per request:\n");
+    printf("%5s%7s%8s%8s%6s", "trace", "Kops",
+	   perfctr_name(PC_CYCLES), perfctr_name(PC_INSTRUCTIONS), "IPC");
+    for (e = PC_L1D_MISSES; e < PC_EVENTS; e++)
+	printf("%10s", perfctr_name(e));
+    printf("\n");
+
+    for (i = 0; i < num_tracefiles; i++) {
+	if (!stats[i].valid)
+	    continue;
+	trace = read_trace(tracedir, tracefiles[i]);
+	speed_params.trace = trace;
+	speed_params.ranges = NULL;
+	eval_mm_speed(&speed_params);
+	perfctr_start();
+	eval_mm_speed(&speed_params);
+	perfctr_stop(counts);
+
+	printf("%2d%10.0f", i, (stats[i].ops/1e3)/stats[i].secs);
+	for (e = 0; e < PC_EVENTS; e++) {
+	    if (e == PC_L1D_MISSES) {
+		if (counts[PC_CYCLES] > 0 && counts[PC_INSTRUCTIONS] >= 0)
+		    printf("%6.2f", counts[PC_INSTRUCTIONS] / counts[PC_CYCLES]);
+		else
+		    printf("%6s", "-");
+	    }
+	    if (counts[e] < 0)
+		printf("%*s", e < PC_L1D_MISSES ? 8 : 10, "-");
+	    else if (e < PC_L1D_MISSES)
+		printf("%8.0f", counts[e] / trace->num_ops);
+	    else
+		printf("%10.3f", counts[e] / trace->num_ops);
+	}
+	printf("\n");
+	free_trace(trace);
+    }
+    printf("\n");
+}
+
+#ifdef MM_THREADS
+/* Payload bytes are tagged with the owning thread's id */
+static int check_block(threads_t *t, char *p, int size, int id)
+{
+    if (p[0] != (char)id || p[size-1] != (char)id) {
+        __atomic_fetch_add(&t->bad, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * replay_thread - Replay a whole trace with a private blocks array,
+ *    then allocate HANDOFF blocks and, once every thread has done the
+ *    same, free the neighbor's. Those frees are the cross-thread ones.
+ */
+static void *replay_thread(void *vargp)
+{
+    traceop_t op;
+    const unsigned char *pos;
+    worker_t *w = (worker_t *)vargp;
+    threads_t *t = w->threads;
+    trace_t *trace = t->trace;
+    worker_t *neighbor = &workers[(w->id + 1) % t->nthreads];
+    char **blocks;
+    int *sizes;
+    int i, index, size;
+    char *p;
+
+    if ((blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+        (sizes = (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+	unix_error("malloc failed in replay_thread");
+
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+	index = op.index;
+	size = op.size;
+
+        switch (op.type) {
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(blocks[index], size)) == NULL)
+		app_error("mm_realloc error in replay_thread");
+	    check_block(t, p, 1, w->id);
+	    p[size-1] = (char)w->id;
+	    blocks[index] = p;
+	    sizes[index] = size;
+	    break;
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc error in replay_thread");
+	    p[0] = p[size-1] = (char)w->id;
+	    blocks[index] = p;
+	    sizes[index] = size;
+	    break;
+
+        case FREE: /* mm_free */
+	    check_block(t, blocks[index], sizes[index], w->id);
+	    mm_free(blocks[index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+        }
+    }
+
+    for (i = 0; i < HANDOFF; i++) {
+	size = (i % 8) * 64 + 16;
+	if ((p = mm_malloc(size)) == NULL)
+	    app_error("mm_malloc error in replay_thread");
+	memset(p, (char)w->id, size);
+	w->handoff[i] = p;
+    }
+
+    pthread_barrier_wait(&t->handoff);
+
+    for (i = 0; i < HANDOFF; i++) {
+	check_block(t, neighbor->handoff[i], (i % 8) * 64 + 16, neighbor->id);
+	mm_free(neighbor->handoff[i]);
+    }
+
+    free(blocks);
+    free(sizes);
+    return NULL;
+}
+
+/*
+ * eval_mm_threads - Replay a trace on several threads at once. This is
+ *    the function that fsecs() times for eval_mm_scaling.
+ */
+static void eval_mm_threads(void *ptr)
+{
+    threads_t *t = (threads_t *)ptr;
+    pthread_t tids[MAX_THREADS];
+    int i;
+
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_threads");
+
+    pthread_barrier_init(&t->handoff, NULL, t->nthreads);
+    for (i = 0; i < t->nthreads; i++) {
+	workers[i].threads = t;
+	workers[i].id = i;
+	if (pthread_create(&tids[i], NULL, replay_thread, &workers[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_threads");
+    }
+    for (i = 0; i < t->nthreads; i++)
+	pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&t->handoff);
+
+    mem_reset();
+}
+
+/*
+ * eval_mm_scaling - Measure the throughput of the mm package with
+ *    1 to max_threads threads each replaying every trace, and the
+ *    speedup over a single thread.
+ */
+static void eval_mm_scaling(char **tracefiles, int num_tracefiles,
+			    int max_threads)
+{
+    double *total_ops, *total_secs;
+    threads_t params;
+    trace_t *trace;
+    double ops, secs, base = 0;
+    int i, n;
+
+    if ((total_ops = (double *)calloc(max_threads + 1, sizeof(double))) == NULL ||
+        (total_secs = (double *)calloc(max_threads + 1, sizeof(double))) == NULL)
+	unix_error("calloc failed in eval_mm_scaling");
+
+    printf("Scaling for mm malloc:\n");
+    printf("%5s%8s%9s%10s%7s%8s\n",
+	   "trace", "threads", "ops", "secs", "Kops", "speedup");
+    for (i = 0; i < num_tracefiles; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	params.trace = trace;
+	for (n = 1; n <= max_threads; n++) {
+	    params.nthreads = n;
+	    params.bad = 0;
+	    secs = fsecs(eval_mm_threads, &params);
+	    if (params.bad) {
+		sprintf(msg, "%d blocks clobbered with %d threads",
+			params.bad, n);
+		malloc_error(i, 0, msg);
+	    }
+	    ops = (double)n * (trace->num_ops + 2 * HANDOFF);
+	    if (n == 1)
+		base = ops / secs;
+	    printf("%2d%11d%9.0f%10.6f%7.0f%7.2fx\n",
+		   i, n, ops, secs, (ops/1e3)/secs, (ops/secs)/base);
+	    total_ops[n] += ops;
+	    total_secs[n] += secs;
+	}
+	free_trace(trace);
+    }
+
+    for (n = 1; n <= max_threads; n++)
+	printf("%-7s%6d%9.0f%10.6f%7.0f%7.2fx\n",
+	       "Total", n, total_ops[n], total_secs[n],
+	       (total_ops[n]/1e3)/total_secs[n],
+	       (total_ops[n]/total_secs[n])/(total_ops[1]/total_secs[1]));
+    printf("\n");
+
+    free(total_ops);
+    free(total_secs);
+}
+#else
+static void eval_mm_scaling(char **tracefiles, int num_tracefiles,
+			    int max_threads)
+{
+    app_error("mdriver: -T needs the thread-safe build (make mdriver-mt)");
+}
+#endif
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -837,32 +1717,35 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
+    traceop_t op;
+    const unsigned char *pos;
     int i, newsize;
     char *p, *newp, *oldp;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+        switch (op.type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op.size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op.index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op.size;
+	    oldp = trace->blocks[op.index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op.index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op.index]);
 	    break;
 
 	default:
@@ -880,34 +1763,36 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
+    traceop_t op;
+    const unsigned char *pos;
     int i;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0, pos = trace->ops;  i < trace->num_ops;  i++) {
+	pos = next_op(trace, pos, &op);
+        switch (op.type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op.index;
+	    size = op.size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldp = trace->blocks[index];
-	    if ((newp = malloc(newsize)) == NULL)
-		unix_error("malloc failed in eval_libc_speed\n");
-            free(oldp);
+	    if ((newp = realloc(oldp, newsize)) == NULL)
+		unix_error("realloc failed in eval_libc_speed\n");
 	    
 	    trace->blocks[index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
@@ -1014,13 +1899,19 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-j <n>] [-L <n>] [-P] [-T <n>] [-S <file>] [-H <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <file>  Dump heap maps during each trace to <file>.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to <n> traces at once, in worker processes.\n");
+    fprintf(stderr, "\t-L <n>     Measure request latency and Kops over <n> runs per trace.\n");
+    fprintf(stderr, "\t-P         Count hardware events per request.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-S <file>  Dump heap stats after every op to <file>.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Measure scaling on 1 to <n> threads (mdriver-mt).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
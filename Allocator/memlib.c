@@ -1,6 +1,30 @@
 /*
  * memlib.c - bridge to mmap
+ *
+ * For the driver, every mapping is recorded in the pagemap so that bad
+ * unmaps are caught, an extra page is mapped now and then so that
+ * mappings are not always adjacent, and a failed mmap aborts. Built
+ * with -DMEM_UNCHECKED, as it is for libmm.so, it does none of that:
+ * the pagemap allocates with malloc, and a malloc has to be able to
+ * report that it is out of memory, so mem_map and mem_remap return
+ * NULL instead.
+ *
+ * -DMEM_REGIONS, which implies -DMEM_UNCHECKED, is the production mode
+ * that libmm.so uses. Mappings smaller than a huge page are carved out
+ * of REGION_SIZE reservations. Each reservation is aligned to HUGE_PAGE
+ * and marked MADV_HUGEPAGE, so that the heap can be backed by
+ * transparent huge pages and take fewer TLB misses, and is made
+ * read-write a huge page at a time as it fills. Pages that are
+ * unmapped stay reserved: once PURGE_PAGES of them have built up, they
+ * are handed back to the kernel with MADV_DONTNEED, a batch at a time
+ * rather than a page at a time so that the huge pages around them are
+ * not split on every free. With -DMEM_LAZY_PURGE they are handed back
+ * with MADV_FREE, which is cheaper but leaves them counted in the RSS
+ * until the kernel is short of memory. Mappings of a huge page or
+ * more get a HUGE_PAGE-aligned mapping of their own. Like the rest of
+ * memlib, none of this locks; mm.c calls in under its map_lock.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -13,6 +37,10 @@
 #include "memlib.h"
 #include "pagemap.h"
 
+#if defined(MEM_REGIONS) && !defined(MEM_UNCHECKED)
+#define MEM_UNCHECKED
+#endif
+
 /* private variables */
 static int activity_counter = 0; /* to simulate other processes */
 
@@ -31,21 +59,244 @@ void mem_init(void)
   }
 }
 
-static void unmap(void *p)
+#ifdef MEM_REGIONS
+#define HUGE_PAGE    (2UL << 20)        /* transparent huge page size */
+#define REGION_SIZE  (32 * HUGE_PAGE)   /* address space reserved at a time */
+#define REGION_PAGES (REGION_SIZE / APAGE_SIZE)
+#define PURGE_PAGES  1024               /* free pages kept backed at most */
+
+#define WORD(i) ((i) / 64)
+#define BIT(i)  (1ULL << ((i) % 64))
+
+/* A reservation. Its bookkeeping is mapped apart from it, so that
+   touching the bookkeeping never faults in a huge page. */
+typedef struct region {
+  struct region *next;
+  char *base;
+  char *committed;      /* pages below this are read-write */
+  size_t used;          /* pages mapped */
+  size_t dirty;         /* pages unmapped but not yet purged */
+  size_t lowest;        /* no free page below this one */
+  uint64_t used_map[REGION_PAGES / 64];
+  uint64_t dirty_map[REGION_PAGES / 64];
+} region_t;
+
+static region_t *regions;
+static size_t dirty_pages;  /* over all regions */
+
+/* Reserve a HUGE_PAGE-aligned run of sz bytes of address space */
+static char *reserve(size_t sz, int prot)
+{
+  char *p, *base;
+  size_t head;
+
+  p = mmap(0, sz + HUGE_PAGE, prot, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  base = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+  head = base - p;
+  if (head > 0)
+    munmap(p, head);
+  munmap(base + sz, HUGE_PAGE - head);
+  madvise(base, sz, MADV_HUGEPAGE);
+  return base;
+}
+
+static region_t *new_region(void)
+{
+  region_t *r;
+
+  r = mmap(0, sizeof(region_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (r == MAP_FAILED)
+    return NULL;
+  if ((r->base = reserve(REGION_SIZE, PROT_NONE)) == NULL) {
+    munmap(r, sizeof(region_t));
+    return NULL;
+  }
+  r->committed = r->base;
+  r->next = regions;
+  regions = r;
+  return r;
+}
+
+static region_t *region_of(void *p)
+{
+  region_t *r;
+
+  for (r = regions; r != NULL; r = r->next)
+    if ((char *)p >= r->base && (char *)p < r->base + REGION_SIZE)
+      return r;
+  return NULL;
+}
+
+/* Returns the first of n free pages in a row, or -1 */
+static long find_free(region_t *r, size_t n)
+{
+  size_t i, run = 0;
+
+  for (i = r->lowest; i < REGION_PAGES; i++) {
+    if (i % 64 == 0 && r->used_map[WORD(i)] == ~0ULL) {
+      i += 63;
+      run = 0;
+    } else if (r->used_map[WORD(i)] & BIT(i))
+      run = 0;
+    else if (++run == n)
+      return i + 1 - n;
+  }
+  return -1;
+}
+
+static int range_free(region_t *r, size_t first, size_t n)
+{
+  size_t i;
+
+  if (first + n > REGION_PAGES)
+    return 0;
+  for (i = first; i < first + n; i++)
+    if (r->used_map[WORD(i)] & BIT(i))
+      return 0;
+  return 1;
+}
+
+/* Map the n free pages from first, committing more of the region if
+   they run past what is read-write */
+static void *take(region_t *r, size_t first, size_t n)
+{
+  char *p = r->base + first * APAGE_SIZE, *end = p + n * APAGE_SIZE;
+  size_t i, grow;
+
+  if (end > r->committed) {
+    grow = ((end - r->committed) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    if (mprotect(r->committed, grow, PROT_READ | PROT_WRITE) < 0)
+      return NULL;
+    r->committed += grow;
+  }
+
+  for (i = first; i < first + n; i++) {
+    r->used_map[WORD(i)] |= BIT(i);
+    if (r->dirty_map[WORD(i)] & BIT(i)) {
+      r->dirty_map[WORD(i)] &= ~BIT(i);
+      r->dirty--;
+      dirty_pages--;
+    }
+  }
+  r->used += n;
+  if (first == r->lowest)
+    r->lowest = first + n;
+  return p;
+}
+
+/* Give every run of unmapped pages back to the kernel */
+static void purge(void)
+{
+  region_t *r;
+  size_t i, first;
+
+  for (r = regions; r != NULL; r = r->next) {
+    for (i = 0; r->dirty > 0 && i < REGION_PAGES; i++) {
+      if (!(r->dirty_map[WORD(i)] & BIT(i)))
+        continue;
+      for (first = i; i < REGION_PAGES && (r->dirty_map[WORD(i)] & BIT(i)); i++) {
+        r->dirty_map[WORD(i)] &= ~BIT(i);
+        r->dirty--;
+      }
+#if defined(MEM_LAZY_PURGE) && defined(MADV_FREE)
+      if (madvise(r->base + first * APAGE_SIZE, (i - first) * APAGE_SIZE, MADV_FREE) == 0)
+        continue;
+#endif
+      madvise(r->base + first * APAGE_SIZE, (i - first) * APAGE_SIZE, MADV_DONTNEED);
+    }
+  }
+  dirty_pages = 0;
+}
+
+/* Unmap n pages from first; a region left empty is released unless
+   it is the only one */
+static void give_back(region_t *r, size_t first, size_t n)
+{
+  region_t **rp;
+  size_t i;
+
+  for (i = first; i < first + n; i++) {
+    r->used_map[WORD(i)] &= ~BIT(i);
+    r->dirty_map[WORD(i)] |= BIT(i);
+  }
+  r->used -= n;
+  r->dirty += n;
+  dirty_pages += n;
+  if (first < r->lowest)
+    r->lowest = first;
+
+  if (r->used == 0 && (r != regions || r->next != NULL)) {
+    for (rp = &regions; *rp != r; rp = &(*rp)->next)
+      ;
+    *rp = r->next;
+    dirty_pages -= r->dirty;
+    munmap(r->base, REGION_SIZE);
+    munmap(r, sizeof(region_t));
+  } else if (dirty_pages >= PURGE_PAGES)
+    purge();
+}
+
+static void *region_map(size_t sz)
+{
+  size_t n = sz / APAGE_SIZE;
+  region_t *r;
+  long first;
+
+  if (sz >= HUGE_PAGE)
+    return reserve(sz, PROT_READ | PROT_WRITE);
+
+  for (r = regions; r != NULL; r = r->next)
+    if (REGION_PAGES - r->used >= n && (first = find_free(r, n)) >= 0)
+      return take(r, first, n);
+  if ((r = new_region()) == NULL)
+    return NULL;
+  return take(r, 0, n);
+}
+
+static void *region_remap(region_t *r, char *p, size_t old_sz, size_t new_sz,
+                          int may_move)
 {
-  if (munmap(p, APAGE_SIZE) < 0) {
+  size_t first = (p - r->base) / APAGE_SIZE;
+  size_t old_n = old_sz / APAGE_SIZE, new_n = new_sz / APAGE_SIZE;
+  char *q;
+
+  if (new_n <= old_n) {
+    if (new_n < old_n)
+      give_back(r, first + new_n, old_n - new_n);
+    return p;
+  }
+  if (new_sz < HUGE_PAGE && range_free(r, first + old_n, new_n - old_n)
+      && take(r, first + old_n, new_n - old_n) != NULL)
+    return p;
+  if (!may_move || (q = region_map(new_sz)) == NULL)
+    return NULL;
+  memcpy(q, p, old_sz);
+  give_back(r, first, old_n);
+  return q;
+}
+#endif
+
+#ifndef MEM_UNCHECKED
+static void unmap(void *p, size_t sz)
+{
+  if (munmap(p, sz) < 0) {
     fprintf(stderr, "unexpected error in munmap: %s (%d)\n",
             strerror(errno), errno);
     abort();
   }
 }
+#endif
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_reset(void)
 {
+#ifndef MEM_UNCHECKED
   pagemap_for_each(unmap);
+#endif
   page_count = 0;
   activity_counter = 0;
 }
@@ -67,7 +318,6 @@ size_t mem_heapsize(void)
 void *mem_map(size_t sz)
 {
   void *p;
-  size_t i;
   
   if (sz & (APAGE_SIZE - 1)) {
     fprintf(stderr, "mem_map: requested size is not a multiple of %d: %ld\n",
@@ -75,6 +325,14 @@ void *mem_map(size_t sz)
     abort();
   }
 
+#if defined(MEM_REGIONS)
+  if ((p = region_map(sz)) == NULL)
+    return NULL;
+#elif defined(MEM_UNCHECKED)
+  p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+#else
   activity_counter++;
   if ((activity_counter & (activity_counter - 1)) == 0) {
     /* allocate a page to ensure that mem_map results are not
@@ -89,17 +347,21 @@ void *mem_map(size_t sz)
     abort();
   }
 
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    pagemap_modify(p + i, 1);
-    page_count++;
-  }
+  pagemap_modify_range(p, sz, 1);
+#endif
+  page_count += sz / APAGE_SIZE;
   
   return p;
 }
 
 void mem_unmap(void *p, size_t sz)
 {
-  size_t i;
+#ifndef MEM_UNCHECKED
+  void *q;
+#endif
+#ifdef MEM_REGIONS
+  region_t *r;
+#endif
   
   if (((uintptr_t)p) & (APAGE_SIZE - 1)) {
     fprintf(stderr, "mem_unmap: given address is not page-aligned: %p\n",
@@ -113,17 +375,23 @@ void mem_unmap(void *p, size_t sz)
     abort();
   }
   
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    if (!pagemap_is_mapped(p+i)) {
-      fprintf(stderr, "mem_unmap: given page is not mapped: %p (in %p:%p)\n",
-              p + i, p, p + sz);
-      abort();
-    }      
+#ifndef MEM_UNCHECKED
+  if ((q = pagemap_first_unmapped(p, sz)) != NULL) {
+    fprintf(stderr, "mem_unmap: given page is not mapped: %p (in %p:%p)\n",
+            q, p, p + sz);
+    abort();
+  }
+
+  pagemap_modify_range(p, sz, 0);
+#endif
+  page_count -= sz / APAGE_SIZE;
 
-    pagemap_modify(p + i, 0);
-    
-    --page_count;
+#ifdef MEM_REGIONS
+  if ((r = region_of(p)) != NULL) {
+    give_back(r, ((char *)p - r->base) / APAGE_SIZE, sz / APAGE_SIZE);
+    return;
   }
+#endif
 
   if (munmap(p, sz) < 0) {
     fprintf(stderr, "munmap failed: %s (%d)\n",
@@ -131,3 +399,64 @@ void mem_unmap(void *p, size_t sz)
     abort();
   }
 }
+
+/*
+ * mem_remap - resize a mapping made by mem_map. Unless may_move is
+ * set, the mapping must stay at p, and NULL is returned when the pages
+ * after it are taken.
+ */
+void *mem_remap(void *p, size_t old_sz, size_t new_sz, int may_move)
+{
+  void *q;
+#ifdef MEM_REGIONS
+  region_t *r;
+#endif
+
+  if (((uintptr_t)p) & (APAGE_SIZE - 1)) {
+    fprintf(stderr, "mem_remap: given address is not page-aligned: %p\n",
+            p);
+    abort();
+  }
+
+  if ((old_sz | new_sz) & (APAGE_SIZE - 1)) {
+    fprintf(stderr, "mem_remap: given size is not a multiple of %d: %ld -> %ld\n",
+            APAGE_SIZE, old_sz, new_sz);
+    abort();
+  }
+
+#ifndef MEM_UNCHECKED
+  if ((q = pagemap_first_unmapped(p, old_sz)) != NULL) {
+    fprintf(stderr, "mem_remap: given page is not mapped: %p (in %p:%p)\n",
+            q, p, p + old_sz);
+    abort();
+  }
+#endif
+
+#ifdef MEM_REGIONS
+  if ((r = region_of(p)) != NULL) {
+    if ((q = region_remap(r, p, old_sz, new_sz, may_move)) != NULL) {
+      page_count -= old_sz / APAGE_SIZE;
+      page_count += new_sz / APAGE_SIZE;
+    }
+    return q;
+  }
+#endif
+
+  q = mremap(p, old_sz, new_sz, may_move ? MREMAP_MAYMOVE : 0);
+  if (q == MAP_FAILED) {
+    if (errno == ENOMEM)
+      return NULL;
+    fprintf(stderr, "mremap failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+
+#ifndef MEM_UNCHECKED
+  pagemap_modify_range(p, old_sz, 0);
+  pagemap_modify_range(q, new_sz, 1);
+#endif
+  page_count -= old_sz / APAGE_SIZE;
+  page_count += new_sz / APAGE_SIZE;
+
+  return q;
+}
@@ -6,5 +6,6 @@ void mem_reset(void);
 size_t mem_pagesize(void);
 void *mem_map(size_t);
 void mem_unmap(void *, size_t);
+void *mem_remap(void *, size_t, size_t, int);
 
 size_t mem_heapsize(void);
@@ -1,17 +1,71 @@
 /*
- * mm-naive.c - The least memory-efficient malloc package.
+ * mm.c - A malloc package that serves small requests from slabs, huge
+ *     ones from mappings of their own and the rest from an arena's chunks.
  *
- * In this naive approach, a block is allocated by allocating a
- * new page as needed.  A block is pure payload. There are no headers or
- * footers.  Blocks are never coalesced or reused.
+ * Chunk blocks have a header, and free ones a footer too, so a freed
+ * block is coalesced with free neighbours on both sides right away.
  *
- * Use explicit free list auto coalesce free blocks
+ * Free blocks are kept in segregated lists by size class: one class per
+ * 16-byte size up to EXACT_LIMIT, then one class per power of two. A
+ * bitmap of non-empty classes lets get_first() find the smallest class
+ * that can satisfy a request with a single count-trailing-zeros.
+ *
+ * The MM_FIT environment variable, read by mm_init, selects how blocks
+ * larger than EXACT_LIMIT are placed. "first" (the default) keeps them
+ * in the power-of-two lists above. "best", "address" and "next" keep
+ * them in a treap instead, ordered by size or by address, so that the
+ * best fit, the lowest-addressed fit or the next fit after the last
+ * placement is found in O(log n). Exact classes are used under every
+ * policy, since a block from the smallest non-empty one is a best fit.
+ *
+ * Requests of up to SLAB_LIMIT bytes bypass all of that. They are
+ * carved from page-sized slabs, each holding objects of one size with a
+ * bitmap of the free ones and no per-object header. A page directory
+ * maps every page the allocator owns to its chunk or slab, which is how
+ * mm_free tells the two apart.
+ *
+ * Requests over HUGE_LIMIT bytes get a mapping of their own, with just
+ * a header in front of the payload. mm_free unmaps it directly and
+ * mm_realloc resizes it with mem_remap, so huge blocks never pass
+ * through the free lists or inflate chunk sizes.
+ *
+ * mm_realloc resizes a block in place when it can: it shrinks by
+ * splitting off the tail, grows by absorbing a free next block, and
+ * grows a block at the end of its chunk by growing the chunk itself
+ * with mem_remap, moving the chunk if the block is its only live one.
+ *
+ * All of that state lives in an arena. The default build has a single
+ * arena and no locking. Built with -DMM_THREADS, there are NUM_ARENAS
+ * arenas, each with its own lock, and threads are assigned to them
+ * round-robin. Each thread also keeps a small cache of recently freed
+ * slab objects (the tcache) that it can reuse without any locking, and
+ * a block freed by a thread outside its arena is pushed on the owning
+ * arena's lock-free remote-free queue, which that arena drains the next
+ * time it is locked.
+ *
+ * mm_memalign carves an aligned block out of a chunk, whatever its size,
+ * by allocating enough to leave a free block in front of the aligned
+ * payload and giving back both that block and the unused tail. In the
+ * threaded build, fork() takes every lock first, so that the child
+ * never inherits a lock held by a thread it does not have.
+ *
+ * mm_stats walks every arena's chunks and adds up the slab and huge
+ * block counters to report how the heap is laid out at that moment,
+ * and mm_sample_sites turns on byte-period sampling of mm_malloc's
+ * callers, which mm_stats reports as well. mm_walk reports the chunks,
+ * their blocks, the slabs and the huge blocks one at a time instead,
+ * for heap maps.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -25,16 +79,20 @@
 /* rounds up to the nearest multiple of mem_pagesize() */
 #define PAGE_ALIGN(size) (((size) + (mem_pagesize() - 1)) & ~(mem_pagesize() - 1))
 
-// This assumes you have a struct or typedef called "block_header" and "block_footer"
-#define OVERHEAD 16
+// An allocated block has only a header; a free block also has a footer,
+// which is what lets the block after it find it. Instead of reading the
+// previous block's footer, a block checks PREV_ALLOC in its own header.
+#define OVERHEAD 8
+#define FREE_OVERHEAD 16
 
-// Given a payload pointer, get the header or footer pointer
+// Given a payload pointer, get the header or (free block) footer pointer
 #define HDRP(bp) ((char *)(bp)-8)
-#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - OVERHEAD)
+#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - FREE_OVERHEAD)
 
-// Given a payload pointer, get the next or previous payload pointer
+// Given a payload pointer, get the next or previous payload pointer;
+// PREV_BLKP is only valid when the previous block is free
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
-#define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE((char *)(bp)-OVERHEAD))
+#define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE((char *)(bp)-FREE_OVERHEAD))
 
 // ******These macros assume you are using a size_t for headers and footers ******
 
@@ -49,8 +107,159 @@
 #define GET_ALLOC(p) (GET(p) & 0x1)
 #define GET_SIZE(p) (GET(p) & ~0xF)
 
+// Set in the header of a block whose previous block is allocated
+#define PREV_ALLOC 0x4
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+
+// Set in the header of a block that has a mapping of its own
+#define HUGE_BIT 0x2
+#define GET_HUGE(p) (GET(p) & HUGE_BIT)
+
 // *******************************************************************************
 
+typedef struct block_header block_header;
+typedef struct block_footer block_footer;
+typedef struct list_ptr list_ptr;
+typedef struct chunk_header chunk_header;
+typedef struct slab slab;
+typedef struct arena arena_t;
+typedef struct tree_node tree_node;
+
+struct block_header
+{
+  size_t size;
+};
+
+struct block_footer
+{
+  size_t size;
+};
+
+struct list_ptr
+{
+  list_ptr *prev;
+  list_ptr *next;
+};
+
+// A free block in the treap keeps this in its payload instead of a
+// list_ptr. `max` is the largest block size in the node's subtree.
+struct tree_node
+{
+  tree_node *left;
+  tree_node *right;
+  size_t max;
+};
+
+// Every chunk starts with a chunk_header, followed by the prologue
+// block, whose payload links the chunk into its arena's page list.
+// Three words put every payload in the chunk on an ALIGNMENT boundary.
+// The chunk ends with an allocated epilogue block of EPILOGUE bytes
+// and a padding word. Every other block is at least ALIGN(MIN_BLOCK)
+// bytes (see BLOCK_SIZE), so walks stop at the first EPILOGUE-sized one.
+struct chunk_header
+{
+  arena_t *arena; // arena whose lists hold the chunk's free blocks
+  size_t size;    // bytes mapped for the chunk
+  size_t live;    // bytes in the chunk's allocated blocks
+};
+
+// Given the prologue payload of a chunk, get its chunk_header, and back
+#define CHUNKP(list) ((chunk_header *)((char *)(list)-8 - sizeof(chunk_header)))
+#define PROLOGUEP(chunk) ((list_ptr *)((char *)((chunk) + 1) + 8))
+
+#define PROLOGUE 32
+#define EPILOGUE 16
+
+// An arena keeps up to RETAIN_CHUNKS chunks of at most RETAIN_SIZE
+// bytes with no live blocks mapped (and on its free lists) rather than
+// unmapping each chunk the moment it empties, so that a heap hovering
+// around a chunk boundary does not map and unmap the same chunk over
+// and over. Larger chunks are always released.
+#define RETAIN_CHUNKS 1
+#define RETAIN_SIZE (64 * 1024)
+
+// Sizes up to EXACT_LIMIT get one class each; larger sizes are grouped
+// by power of two. Class 0 holds the minimum free block size.
+#define MIN_BLOCK (FREE_OVERHEAD + sizeof(list_ptr))
+
+// Chunk block size for a payload of size bytes. Small payloads get a
+// block big enough to be freed, which also keeps them from looking
+// like the epilogue.
+#define BLOCK_SIZE(size) \
+  (((size) + OVERHEAD < MIN_BLOCK) ? ALIGN(MIN_BLOCK) : ALIGN((size) + OVERHEAD))
+#define EXACT_LIMIT 512
+#define EXACT_CLASSES ((EXACT_LIMIT - MIN_BLOCK) / ALIGNMENT + 1)
+#define NUM_CLASSES 64
+
+// Placement policies for blocks above EXACT_LIMIT
+#define FIT_FIRST 0   // power-of-two lists, first fit within a list
+#define FIT_BEST 1    // treap by size, then address
+#define FIT_ADDRESS 2 // treap by address, lowest address that fits
+#define FIT_NEXT 3    // treap by address, first fit after the last one
+
+static int fit_policy;
+
+// Requests up to SLAB_LIMIT bytes are rounded to a multiple of
+// ALIGNMENT and served from the slabs of that size.
+#define SLAB_LIMIT 256
+#define SLAB_CLASSES (SLAB_LIMIT / ALIGNMENT)
+#define SLAB_CLASS(size) ((size) / ALIGNMENT - 1)
+#define SLAB_WORDS 4 // enough bits for a page of ALIGNMENT-sized objects
+
+// A slab is one page: this header, then `capacity` objects of `size`
+// bytes starting at SLAB_OBJECTS.
+struct slab
+{
+  slab *prev; // on its arena's list for the size while it has free objects,
+             // and on the arena's full_slabs list while it has none
+  slab *next;
+  arena_t *arena;
+  unsigned size;
+  unsigned capacity;
+  unsigned nfree;
+  unsigned long long free_map[SLAB_WORDS]; // bit i set when object i is free
+};
+
+#define SLAB_OBJECTS ALIGN(sizeof(slab))
+
+struct arena
+{
+  list_ptr *free_lists[NUM_CLASSES];
+  unsigned long long free_bitmap; // bit c set when free_lists[c] is non-empty
+  list_ptr *page_head;
+  tree_node *tree; // blocks above EXACT_LIMIT, unless fit_policy is FIT_FIRST
+  void *rover;     // where FIT_NEXT resumes
+  int mapped;
+  int empty_chunks; // chunks with live == 0
+  slab *slabs[SLAB_CLASSES];
+  slab *full_slabs;  // slabs of every size with no free objects
+  size_t slab_count; // slabs mapped, full or not
+  size_t slab_live;  // bytes in allocated slab objects
+#ifdef MM_THREADS
+  pthread_mutex_t lock;
+  void *remote_frees; // blocks freed by other threads, linked through their payloads
+#endif
+} __attribute__((aligned(64)));
+
+#ifdef MM_THREADS
+#define NUM_ARENAS 8
+#else
+#define NUM_ARENAS 1
+#endif
+
+static arena_t arenas[NUM_ARENAS];
+
+#if MM_STATS_CLASSES != NUM_CLASSES
+#error "mm.h and mm.c disagree on the number of size classes"
+#endif
+
+// Huge blocks are on no arena, so they are counted and listed (for
+// mm_walk) here; all three are updated with map_lock held in the
+// threaded build.
+static size_t huge_count;
+static size_t huge_bytes;
+static list_ptr *huge_head;
+
 // ******Recommended helper functions******
 
 /* These functions will provide a high-level recommended structure to your program.
@@ -67,77 +276,780 @@ void set_allocated(void *b, size_t size);
 /* Request more memory by calling mem_map
  * Initialize the new chunk of memory as applicable
  * Update free list if applicable
+ * Returns -1 if mem_map is out of memory
  */
-void extend(size_t s);
+int extend(arena_t *a, size_t s);
 
 /* Coalesce a free block if applicable
  * Returns pointer to new coalesced block
  */
 void *coalesce(void *bp);
 
-typedef struct block_header block_header;
-typedef struct block_footer block_footer;
-typedef struct list_ptr list_ptr;
+/* Map a block size to its size class.
+ */
+static int size_class(size_t size);
 
-struct block_header
-{
-  size_t size;
-};
+/* Get first free block.
+ */
+void *get_first(arena_t *a, size_t size);
 
-struct block_footer
-{
-  size_t size;
-};
+void add(arena_t *a, list_ptr *ptr, int page);
 
-struct list_ptr
-{
-  list_ptr *prev;
-  list_ptr *next;
-};
+void remove_from_list(arena_t *a, list_ptr *ptr, int page);
 
-int mapped;
+/* Unmap a chunk whose blocks have all been freed and coalesced into
+ * the single free block `bp`.
+ */
+void unmap_page(arena_t *a, chunk_header *chunk, void *bp);
 
-list_ptr *free_head = NULL;
-list_ptr *page_head = NULL;
+/* Allocate or free a block of an already-aligned size in one arena;
+ * the caller holds the arena's lock.
+ */
+static void *arena_malloc(arena_t *a, size_t size);
+static void arena_free(arena_t *a, chunk_header *chunk, void *ptr);
 
-/* Get first free block.
+/* Resize an allocated block to an already-aligned size without copying
+ * it, returning NULL if it cannot; the caller holds the arena's lock.
+ * The block only moves if its whole chunk does.
+ */
+static void *arena_resize(arena_t *a, chunk_header *chunk, void *ptr, size_t size);
+
+/* Allocate or free an object of an already-aligned size up to
+ * SLAB_LIMIT; the caller holds the arena's lock.
+ */
+static void *slab_malloc(arena_t *a, size_t size);
+static void slab_free(slab *s, void *ptr);
+
+// A huge block's mapping starts with HUGE_HEADER bytes: its links in
+// the huge list, a padding word, then a block header holding the
+// mapping's size and HUGE_BIT.
+#define HUGE_LIMIT (64 * 1024)
+#define HUGE_HEADER 32
+
+/* Map, unmap or resize a huge block.
  */
-void *get_first(size_t size);
+static void *huge_malloc(size_t size);
+static void huge_free(void *ptr);
+static void *huge_realloc(void *ptr, size_t size);
 
-void add(list_ptr *ptr, int page);
+// The page directory maps every page of a chunk to its chunk_header,
+// every slab page to its slab with SLAB_TAG set, and every page of a
+// huge block to its mapping with HUGE_TAG set. Like the driver's
+// pagemap, it lives outside the simulated heap.
+#define DIR_PAGE_BITS 12 // log2 of mem_pagesize()
+#define DIR_LEAF_BITS 18
+#define DIR_ROOT_BITS (47 - DIR_PAGE_BITS - DIR_LEAF_BITS)
+#define DIR_LEAF_MASK ((1UL << DIR_LEAF_BITS) - 1)
 
-void remove_from_list(list_ptr *ptr, int page);
+#define SLAB_TAG 1
+#define IS_SLAB(owner) ((uintptr_t)(owner)&SLAB_TAG)
+#define SLABP(owner) ((slab *)((uintptr_t)(owner) & ~(uintptr_t)SLAB_TAG))
+#define HUGE_TAG 2
+#define IS_HUGE(owner) ((uintptr_t)(owner)&HUGE_TAG)
+
+static void **page_dir[1UL << DIR_ROOT_BITS];
+
+static void dir_set(void *start, size_t size, void *owner);
+static void *dir_get(void *bp);
+
+/* Free a block or slab object, given its page directory entry; the
+ * caller holds the owning arena's lock.
+ */
+static void free_owned(arena_t *a, void *ptr, void *owner);
 
-/* Unmap unused pages.
+/* Record the callsite of a sampled mm_malloc call.
  */
-void unmap_page();
+static void sample_site(void *site, size_t size);
+
+/* mm_malloc without the sampling: find room for a block of size bytes
+ */
+static void *place(size_t size);
+
+#ifdef MM_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+// When sample_period is non-zero, a thread samples the mm_malloc call
+// that takes its byte countdown to zero. Sites are kept in first-come
+// order; once the table is full, new sites are not recorded.
+static size_t sample_period;
+static THREAD_LOCAL long sample_left;
+static mm_site_t sites[MM_STATS_SITES];
+static int num_sites;
+
+#ifdef MM_THREADS
+
+// Each thread caches up to TCACHE_DEPTH free objects of every slab size,
+// linked through their payloads. Cached objects stay marked allocated
+// in their slabs, so nothing else in the heap sees them.
+#define TCACHE_DEPTH 16
+#define TCACHE_BINS (SLAB_LIMIT / ALIGNMENT + 1)
+
+typedef struct tcache
+{
+  void *bins[TCACHE_BINS];
+  int counts[TCACHE_BINS];
+  unsigned generation;
+} tcache_t;
+
+static __thread tcache_t tcache;
+static __thread arena_t *thread_arena;
+
+// Bumped by mm_init; a tcache filled before then holds blocks of a heap
+// that no longer exists and is dropped rather than flushed.
+static unsigned generation;
+
+static unsigned next_arena;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+
+// memlib and the page directory are shared by all arenas.
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_arenas(void);
+static arena_t *my_arena(void);
+static void free_to_owner(void *ptr, void *owner);
+
+#endif
 
 /*
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
-  free_head = NULL;
-  page_head = NULL;
-  mapped = 0;
+  char *fit = getenv("MM_FIT");
+  int i;
+
+  if (fit == NULL || !strcmp(fit, "first"))
+    fit_policy = FIT_FIRST;
+  else if (!strcmp(fit, "best"))
+    fit_policy = FIT_BEST;
+  else if (!strcmp(fit, "address"))
+    fit_policy = FIT_ADDRESS;
+  else if (!strcmp(fit, "next"))
+    fit_policy = FIT_NEXT;
+  else
+  {
+    fprintf(stderr, "mm: unknown MM_FIT policy %s\n", fit);
+    return -1;
+  }
+
+#ifdef MM_THREADS
+  pthread_once(&arenas_once, init_arenas);
+  generation++;
+#endif
+
+  for (i = 0; i < NUM_ARENAS; i++)
+  {
+    arena_t *a = &arenas[i];
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->free_bitmap = 0;
+    a->page_head = NULL;
+    a->tree = NULL;
+    a->rover = NULL;
+    a->mapped = 0;
+    a->empty_chunks = 0;
+    memset(a->slabs, 0, sizeof(a->slabs));
+    a->full_slabs = NULL;
+    a->slab_count = 0;
+    a->slab_live = 0;
+#ifdef MM_THREADS
+    a->remote_frees = NULL;
+#endif
+  }
+  huge_count = 0;
+  huge_bytes = 0;
+  huge_head = NULL;
+  num_sites = 0;
+  memset(sites, 0, sizeof(sites));
   return 0;
 }
 
+#ifdef MM_THREADS
+
+static void tcache_reset(void)
+{
+  memset(tcache.bins, 0, sizeof(tcache.bins));
+  memset(tcache.counts, 0, sizeof(tcache.counts));
+  tcache.generation = generation;
+  // Registers tcache_flush to run when the thread exits
+  pthread_setspecific(tcache_key, &tcache);
+}
+
+static void *tcache_get(size_t size)
+{
+  int bin = size / ALIGNMENT;
+  void *bp;
+
+  if (tcache.generation != generation)
+    tcache_reset();
+
+  if ((bp = tcache.bins[bin]) != NULL)
+  {
+    tcache.bins[bin] = *(void **)bp;
+    tcache.counts[bin]--;
+  }
+  return bp;
+}
+
+static int tcache_put(void *bp, size_t size)
+{
+  int bin = size / ALIGNMENT;
+
+  if (tcache.generation != generation)
+    tcache_reset();
+
+  if (tcache.counts[bin] == TCACHE_DEPTH)
+    return 0;
+
+  *(void **)bp = tcache.bins[bin];
+  tcache.bins[bin] = bp;
+  tcache.counts[bin]++;
+  return 1;
+}
+
+static void tcache_flush(void *unused)
+{
+  int bin;
+  void *bp;
+
+  if (tcache.generation != generation)
+    return;
+
+  for (bin = 0; bin < TCACHE_BINS; bin++)
+  {
+    while ((bp = tcache.bins[bin]) != NULL)
+    {
+      tcache.bins[bin] = *(void **)bp;
+      free_to_owner(bp, dir_get(bp));
+    }
+    tcache.counts[bin] = 0;
+  }
+}
+
+// Arena locks are taken before map_lock everywhere else, and no one
+// holds sites_lock with another lock
+static void lock_all(void)
+{
+  int i;
+
+  for (i = 0; i < NUM_ARENAS; i++)
+    pthread_mutex_lock(&arenas[i].lock);
+  pthread_mutex_lock(&map_lock);
+  pthread_mutex_lock(&sites_lock);
+}
+
+static void unlock_all(void)
+{
+  int i;
+
+  pthread_mutex_unlock(&sites_lock);
+  pthread_mutex_unlock(&map_lock);
+  for (i = NUM_ARENAS - 1; i >= 0; i--)
+    pthread_mutex_unlock(&arenas[i].lock);
+}
+
+static void init_arenas(void)
+{
+  int i;
+
+  for (i = 0; i < NUM_ARENAS; i++)
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  pthread_key_create(&tcache_key, tcache_flush);
+  pthread_atfork(lock_all, unlock_all, unlock_all);
+}
+
+static arena_t *my_arena(void)
+{
+  if (thread_arena == NULL)
+    thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+  return thread_arena;
+}
+
+static void push_remote_free(arena_t *a, void *bp)
+{
+  void *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+
+  do
+  {
+    *(void **)bp = head;
+  } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, bp, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Called with the arena locked. The whole queue is taken at once, so
+// pushes never race with pops.
+static void drain_remote_frees(arena_t *a)
+{
+  void *bp, *next;
+
+  if (__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  bp = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  while (bp != NULL)
+  {
+    next = *(void **)bp;
+    free_owned(a, bp, dir_get(bp));
+    bp = next;
+  }
+}
+
+static void free_to_owner(void *ptr, void *owner)
+{
+  arena_t *a = IS_SLAB(owner) ? SLABP(owner)->arena : ((chunk_header *)owner)->arena;
+
+  if (a != my_arena())
+  {
+    push_remote_free(a, ptr);
+    return;
+  }
+
+  pthread_mutex_lock(&a->lock);
+  drain_remote_frees(a);
+  free_owned(a, ptr, owner);
+  pthread_mutex_unlock(&a->lock);
+}
+
+#endif
+
+static void free_owned(arena_t *a, void *ptr, void *owner)
+{
+  if (IS_SLAB(owner))
+    slab_free(SLABP(owner), ptr);
+  else
+    arena_free(a, owner, ptr);
+}
+
+// Called with map_lock held in the threaded build
+static void dir_set(void *start, size_t size, void *owner)
+{
+  uintptr_t page = (uintptr_t)start >> DIR_PAGE_BITS;
+  uintptr_t end = page + (size >> DIR_PAGE_BITS);
+  void ***leaf;
+
+  for (; page < end; page++)
+  {
+    leaf = &page_dir[page >> DIR_LEAF_BITS];
+    if (*leaf == NULL)
+    {
+      *leaf = mmap(NULL, sizeof(void *) << DIR_LEAF_BITS, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (*leaf == MAP_FAILED)
+      {
+        fprintf(stderr, "mm: cannot map page directory\n");
+        abort();
+      }
+    }
+    (*leaf)[page & DIR_LEAF_MASK] = owner;
+  }
+}
+
+static void *dir_get(void *bp)
+{
+  uintptr_t page = (uintptr_t)bp >> DIR_PAGE_BITS;
+  return page_dir[page >> DIR_LEAF_BITS][page & DIR_LEAF_MASK];
+}
+
 /*
- * mm_malloc - Allocate a block by using bytes from current_avail,
- *     grabbing a new page if necessary.
+ * mm_malloc - Allocate a block from a slab, an arena or a mapping of its own.
  */
 void *mm_malloc(size_t size)
 {
-  size = ALIGN(size + OVERHEAD);
+  return mm_malloc_at(size, __builtin_return_address(0));
+}
+
+void *mm_malloc_at(size_t size, void *site)
+{
+  if (sample_period != 0)
+    sample_site(site, size);
+  return place(size);
+}
+
+static void *place(size_t size)
+{
+  int small = (size <= SLAB_LIMIT);
+
+  if (size > HUGE_LIMIT)
+    return huge_malloc(size);
+
+  size = small ? ALIGN(size ? size : 1) : ALIGN(size + OVERHEAD);
+#ifdef MM_THREADS
+  arena_t *a;
+  void *ptr;
+
+  if (small && (ptr = tcache_get(size)) != NULL)
+    return ptr;
+
+  a = my_arena();
+  pthread_mutex_lock(&a->lock);
+  drain_remote_frees(a);
+  ptr = small ? slab_malloc(a, size) : arena_malloc(a, size);
+  pthread_mutex_unlock(&a->lock);
+  return ptr;
+#else
+  return small ? slab_malloc(&arenas[0], size) : arena_malloc(&arenas[0], size);
+#endif
+}
+
+/*
+ * mm_free - Return a block to its slab, its arena's free lists or the kernel.
+ */
+void mm_free(void *ptr)
+{
+  void *owner = dir_get(ptr);
+
+  if (IS_HUGE(owner))
+  {
+    huge_free(ptr);
+    return;
+  }
+
+#ifdef MM_THREADS
+  if (IS_SLAB(owner) && tcache_put(ptr, SLABP(owner)->size))
+    return;
+  free_to_owner(ptr, owner);
+#else
+  free_owned(&arenas[0], ptr, owner);
+#endif
+}
+
+/*
+ * mm_realloc - Resize in place if possible, and otherwise allocate,
+ *     copy and free.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+  return mm_realloc_at(ptr, size, __builtin_return_address(0));
+}
+
+void *mm_realloc_at(void *ptr, size_t size, void *site)
+{
+  void *owner, *newp;
+  size_t old_size;
+
+  if (ptr == NULL)
+    return mm_malloc_at(size, site);
+  if (size == 0)
+  {
+    mm_free(ptr);
+    return NULL;
+  }
+
+  owner = dir_get(ptr);
+  if (IS_HUGE(owner))
+  {
+    if (size > HUGE_LIMIT)
+      return huge_realloc(ptr, size);
+    old_size = GET_SIZE(HDRP(ptr)) - HUGE_HEADER;
+  }
+  else if (IS_SLAB(owner))
+  {
+    old_size = SLABP(owner)->size;
+    if (size <= old_size)
+      return ptr;
+  }
+  else if (size > HUGE_LIMIT)
+  {
+    old_size = GET_SIZE(HDRP(ptr)) - OVERHEAD;
+  }
+  else
+  {
+    // Read the arena first: the chunk may move
+    arena_t *a = ((chunk_header *)owner)->arena;
+#ifdef MM_THREADS
+    pthread_mutex_lock(&a->lock);
+#endif
+    newp = arena_resize(a, owner, ptr, BLOCK_SIZE(size));
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&a->lock);
+#endif
+    if (newp != NULL)
+      return newp;
+    old_size = GET_SIZE(HDRP(ptr)) - OVERHEAD;
+  }
+
+  if ((newp = mm_malloc_at(size, site)) == NULL)
+    return NULL;
+  memcpy(newp, ptr, (old_size < size) ? old_size : size);
+  mm_free(ptr);
+  return newp;
+}
+
+/*
+ * mm_memalign - Allocate a block whose payload is a multiple of
+ *     `alignment`, a power of two.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+  return mm_memalign_at(alignment, size, __builtin_return_address(0));
+}
+
+void *mm_memalign_at(size_t alignment, size_t size, void *site)
+{
+  size_t asize = BLOCK_SIZE(size), front, whole;
+  chunk_header *chunk;
+  arena_t *a;
+  char *ptr, *aligned;
+
+  if (alignment <= ALIGNMENT)
+    return mm_malloc_at(size, site);
+  if (sample_period != 0)
+    sample_site(site, size);
+
+#ifdef MM_THREADS
+  a = my_arena();
+  pthread_mutex_lock(&a->lock);
+  drain_remote_frees(a);
+#else
+  a = &arenas[0];
+#endif
+  ptr = arena_malloc(a, asize + alignment + MIN_BLOCK);
+  if (ptr != NULL)
+  {
+    chunk = dir_get(ptr);
+    if ((uintptr_t)ptr & (alignment - 1))
+    {
+      // The block came off a free list, so the one before it is
+      // allocated and the part in front needs no coalescing
+      aligned = (char *)(((uintptr_t)ptr + MIN_BLOCK + alignment - 1) & ~(alignment - 1));
+      front = aligned - ptr;
+      whole = GET_SIZE(HDRP(ptr));
+      set_allocated(HDRP(ptr), PACK(front, 0));
+      set_allocated(HDRP(aligned), PACK(whole - front, 1));
+      chunk->live -= front;
+      add(a, (list_ptr *)ptr, 0);
+      ptr = aligned;
+    }
+    ptr = arena_resize(a, chunk, ptr, asize);
+  }
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&a->lock);
+#endif
+  return ptr;
+}
+
+/*
+ * mm_usable_size - Bytes of payload in an allocated block.
+ */
+size_t mm_usable_size(void *ptr)
+{
+  void *owner = dir_get(ptr);
+
+  if (IS_HUGE(owner))
+    return GET_SIZE(HDRP(ptr)) - HUGE_HEADER;
+  if (IS_SLAB(owner))
+    return SLABP(owner)->size;
+  return GET_SIZE(HDRP(ptr)) - OVERHEAD;
+}
+
+// Called with map_lock held in the threaded build
+static void huge_link(char *region)
+{
+  list_ptr *l = (list_ptr *)region;
+
+  l->prev = NULL;
+  l->next = huge_head;
+  if (huge_head != NULL)
+    huge_head->prev = l;
+  huge_head = l;
+}
+
+static void huge_unlink(char *region)
+{
+  list_ptr *l = (list_ptr *)region;
+
+  if (l->prev != NULL)
+    l->prev->next = l->next;
+  else
+    huge_head = l->next;
+  if (l->next != NULL)
+    l->next->prev = l->prev;
+}
+
+static void *huge_malloc(size_t size)
+{
+  size_t mapped = PAGE_ALIGN(size + HUGE_HEADER);
+  char *region;
+
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  region = mem_map(mapped);
+  if (region != NULL)
+  {
+    dir_set(region, mapped, region + HUGE_TAG);
+    huge_link(region);
+    huge_count++;
+    huge_bytes += mapped;
+  }
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
+  if (region == NULL)
+    return NULL;
+
+  PUT(region + HUGE_HEADER - 8, PACK(mapped, HUGE_BIT | 1));
+  return region + HUGE_HEADER;
+}
+
+static void huge_free(void *ptr)
+{
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  huge_unlink((char *)ptr - HUGE_HEADER);
+  huge_count--;
+  huge_bytes -= GET_SIZE(HDRP(ptr));
+  mem_unmap((char *)ptr - HUGE_HEADER, GET_SIZE(HDRP(ptr)));
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
+}
+
+static void *huge_realloc(void *ptr, size_t size)
+{
+  size_t old_mapped = GET_SIZE(HDRP(ptr));
+  size_t mapped = PAGE_ALIGN(size + HUGE_HEADER);
+  char *old_region = (char *)ptr - HUGE_HEADER, *region;
+
+  if (mapped == old_mapped)
+    return ptr;
+
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  // The list may point into the old mapping, which can move
+  huge_unlink(old_region);
+  region = mem_remap(old_region, old_mapped, mapped, 1);
+  if (region != NULL)
+  {
+    dir_set(region, mapped, region + HUGE_TAG);
+    huge_bytes += mapped - old_mapped;
+  }
+  huge_link(region != NULL ? region : old_region);
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
+
+  if (region == NULL)
+    return NULL;
+
+  PUT(region + HUGE_HEADER - 8, PACK(mapped, HUGE_BIT | 1));
+  return region + HUGE_HEADER;
+}
+
+static void *slab_malloc(arena_t *a, size_t size)
+{
+  slab **head = &a->slabs[SLAB_CLASS(size)];
+  slab *s = *head;
+  int w, i;
+
+  if (s == NULL)
+  {
+#ifdef MM_THREADS
+    pthread_mutex_lock(&map_lock);
+#endif
+    s = mem_map(mem_pagesize());
+    if (s != NULL)
+      dir_set(s, mem_pagesize(), (void *)((uintptr_t)s | SLAB_TAG));
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&map_lock);
+#endif
+    if (s == NULL)
+      return NULL;
+
+    s->prev = s->next = NULL;
+    s->arena = a;
+    a->slab_count++;
+    s->size = size;
+    s->capacity = s->nfree = (mem_pagesize() - SLAB_OBJECTS) / size;
+    memset(s->free_map, 0, sizeof(s->free_map));
+    for (i = 0; i < s->capacity; i++)
+      s->free_map[i / 64] |= 1ULL << (i % 64);
+    *head = s;
+  }
+
+  for (w = 0; s->free_map[w] == 0; w++)
+    ;
+  i = __builtin_ctzll(s->free_map[w]);
+  s->free_map[w] &= ~(1ULL << i);
+  a->slab_live += size;
+
+  // A full slab moves to the full list until one of its objects is freed
+  if (--s->nfree == 0)
+  {
+    *head = s->next;
+    if (s->next != NULL)
+      s->next->prev = NULL;
+    s->next = a->full_slabs;
+    if (s->next != NULL)
+      s->next->prev = s;
+    a->full_slabs = s;
+  }
+
+  return (char *)s + SLAB_OBJECTS + (w * 64 + i) * s->size;
+}
+
+static void slab_free(slab *s, void *ptr)
+{
+  slab **head = &s->arena->slabs[SLAB_CLASS(s->size)];
+  unsigned i = ((char *)ptr - ((char *)s + SLAB_OBJECTS)) / s->size;
+
+  s->free_map[i / 64] |= 1ULL << (i % 64);
+  s->arena->slab_live -= s->size;
+
+  if (s->nfree++ == 0)
+  {
+    if (s->prev != NULL)
+      s->prev->next = s->next;
+    else
+      s->arena->full_slabs = s->next;
+    if (s->next != NULL)
+      s->next->prev = s->prev;
+    s->prev = NULL;
+    s->next = *head;
+    if (*head != NULL)
+      (*head)->prev = s;
+    *head = s;
+  }
+
+  // Keep the last slab of each size even when it empties, so that a
+  // size that keeps going to zero objects does not map and unmap a page
+  // every time
+  if (s->nfree == s->capacity && (s->prev != NULL || s->next != NULL))
+  {
+    if (s->prev != NULL)
+      s->prev->next = s->next;
+    else
+      *head = s->next;
+    if (s->next != NULL)
+      s->next->prev = s->prev;
+    s->arena->slab_count--;
+#ifdef MM_THREADS
+    pthread_mutex_lock(&map_lock);
+#endif
+    mem_unmap(s, mem_pagesize());
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&map_lock);
+#endif
+  }
+}
+
+static void *arena_malloc(arena_t *a, size_t size)
+{
   // show_pages();
   void *ptr;
-  while ((ptr = get_first(size)) == NULL)
+  while ((ptr = get_first(a, size)) == NULL)
   {
-    extend(size);
+    if (extend(a, size) < 0)
+      return NULL;
   }
 
-  if (GET_SIZE(HDRP(ptr)) - size <= OVERHEAD + sizeof(list_ptr))
+  if (GET_SIZE(HDRP(ptr)) - size < MIN_BLOCK)
   {
     size = GET_SIZE(HDRP(ptr));
   }
@@ -147,44 +1059,47 @@ void *mm_malloc(size_t size)
   size_t size_remain = GET_SIZE(HDRP(ptr)) - size;
   // printf("Size remain: %d\n", size_remain);
 
-  remove_from_list(ptr, 0);
+  remove_from_list(a, ptr, 0);
   set_allocated(HDRP(ptr), PACK(size, 1));
 
+  chunk_header *chunk = dir_get(ptr);
+  if (chunk->live == 0)
+  {
+    a->empty_chunks--;
+  }
+  chunk->live += size;
+
   if (size_remain > 0)
   {
     set_allocated(HDRP(NEXT_BLKP(ptr)), PACK(size_remain, 0));
     // printf("Add remain %d\n", size_remain);
-    add(NEXT_BLKP(ptr), 0);
+    add(a, (list_ptr *)NEXT_BLKP(ptr), 0);
   }
   // printf("Allocated: %p\n", ptr);
 
   return ptr;
 }
 
-/*
- * mm_free - Freeing a block does nothing.
- */
-void mm_free(void *ptr)
+static void arena_free(arena_t *a, chunk_header *chunk, void *ptr)
 {
   // printf("Call free on %p\n", ptr);
   // printf("Current has size %d\n", (GET_SIZE(HDRP(ptr))));
-  unmap_page();
+  chunk->live -= GET_SIZE(HDRP(ptr));
 
-  void *prev_block = PREV_BLKP(ptr);
   void *next_block = NEXT_BLKP(ptr);
 
   set_allocated(HDRP(ptr), PACK(GET_SIZE(HDRP(ptr)), 0));
 
-  // printf("Pre size: %d\n", *(size_t *)((char *)ptr - OVERHEAD));
-  // printf("Pre: %p\n", prev_block);
   // printf("Next: %p\n", next_block);
 
-  if (GET_ALLOC(HDRP(prev_block)) == 0)
+  if (GET_PREV_ALLOC(HDRP(ptr)) == 0)
   {
+    void *prev_block = PREV_BLKP(ptr);
+
     // printf("Merge prev\n");
     // printf("Prev has size %d\n", GET_SIZE(HDRP(prev_block)));
 
-    remove_from_list(prev_block, 0);
+    remove_from_list(a, prev_block, 0);
     set_allocated(HDRP(prev_block), PACK(GET_SIZE(HDRP(prev_block)) + GET_SIZE(HDRP(ptr)), 0));
     ptr = prev_block;
   }
@@ -192,159 +1107,702 @@ void mm_free(void *ptr)
   if (GET_ALLOC(HDRP(next_block)) == 0)
   {
     // printf("Merge next\n");
-    remove_from_list(next_block, 0);
+    remove_from_list(a, next_block, 0);
     set_allocated(HDRP(ptr), PACK(GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(next_block)), 0));
   }
-  add(ptr, 0);
+  add(a, ptr, 0);
+
+  // With no live blocks left, everything between the prologue and the
+  // epilogue has coalesced into ptr
+  if (chunk->live == 0 && (++a->empty_chunks > RETAIN_CHUNKS || chunk->size > RETAIN_SIZE))
+  {
+    unmap_page(a, chunk, ptr);
+  }
 }
 
-void set_allocated(void *b, size_t size)
+// Takes every free block of a chunk, and the chunk itself, off the
+// arena's lists, or puts them back.
+static void relink_chunk(arena_t *a, chunk_header *chunk, int on)
 {
-  *((size_t *)b) = size;
-  b = (char *)b + 8;
-  *((size_t *)FTRP(b)) = size;
+  list_ptr *bp = PROLOGUEP(chunk);
+
+  if (on)
+    add(a, bp, 1);
+  else
+    remove_from_list(a, bp, 1);
+
+  for (bp = (list_ptr *)NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) != EPILOGUE; bp = (list_ptr *)NEXT_BLKP(bp))
+  {
+    if (GET_ALLOC(HDRP(bp)) == 0)
+    {
+      if (on)
+        add(a, bp, 0);
+      else
+        remove_from_list(a, bp, 0);
+    }
+  }
 }
 
-void add(list_ptr *ptr, int page)
+// Grows a chunk by at least `need` bytes, turning the old epilogue into
+// a free block that is merged with the free block before it, if any.
+// Unless may_move is set the chunk stays put, and NULL is returned if
+// the pages after it are taken. A chunk may only move when the caller
+// owns every allocated block in it.
+static chunk_header *grow_chunk(arena_t *a, chunk_header *chunk, size_t need, int may_move)
 {
-  // printf("Add: %p\n", ptr);
+  size_t old_size = chunk->size;
+  size_t new_size = PAGE_ALIGN(old_size + need);
+  chunk_header *moved;
+  void *bp, *prev;
 
-  ptr->next = NULL;
-  ptr->prev = NULL;
-  if (!page)
+  // List links point into the chunk, so unlink it before it moves
+  if (may_move)
+    relink_chunk(a, chunk, 0);
+
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  moved = mem_remap(chunk, old_size, new_size, may_move);
+  if (moved == chunk)
+    dir_set((char *)chunk + old_size, new_size - old_size, chunk);
+  else if (moved != NULL)
+    dir_set(moved, new_size, moved);
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
+
+  if (may_move)
+    relink_chunk(a, (moved != NULL) ? moved : chunk, 1);
+  if (moved == NULL)
+    return NULL;
+
+  chunk = moved;
+  chunk->size = new_size;
+
+  // The old epilogue header sits EPILOGUE + 8 bytes before the old end
+  bp = (char *)chunk + old_size - EPILOGUE;
+  set_allocated(HDRP(bp), PACK(new_size - old_size, 0));
+  set_allocated(HDRP(NEXT_BLKP(bp)), PACK(EPILOGUE, 1));
+
+  if (GET_PREV_ALLOC(HDRP(bp)) == 0)
+  {
+    prev = PREV_BLKP(bp);
+    remove_from_list(a, prev, 0);
+    set_allocated(HDRP(prev), PACK(GET_SIZE(HDRP(prev)) + GET_SIZE(HDRP(bp)), 0));
+    bp = prev;
+  }
+  add(a, bp, 0);
+  return chunk;
+}
+
+static void *arena_resize(arena_t *a, chunk_header *chunk, void *ptr, size_t size)
+{
+  size_t old_size = GET_SIZE(HDRP(ptr));
+  size_t cur = old_size;
+  void *next = NEXT_BLKP(ptr);
+  void *rest;
+
+  if (size > cur)
   {
-    if (free_head == NULL)
+    size_t avail = cur;
+    void *last = next;
+
+    if (GET_ALLOC(HDRP(next)) == 0)
     {
-      free_head = ptr;
-      return;
+      avail += GET_SIZE(HDRP(next));
+      last = NEXT_BLKP(next);
+    }
+
+    // A chunk whose only live block is ptr can move, taking ptr with
+    // it, when it cannot grow in place.
+    if (avail < size && GET_SIZE(HDRP(last)) == EPILOGUE)
+    {
+      chunk_header *grown = grow_chunk(a, chunk, size - avail, 0);
+
+      if (grown == NULL && chunk->live == old_size)
+        grown = grow_chunk(a, chunk, size - avail, 1);
+      if (grown == NULL)
+        return NULL;
+      ptr = (char *)grown + ((char *)ptr - (char *)chunk);
+      chunk = grown;
+      next = NEXT_BLKP(ptr);
+      avail = cur + GET_SIZE(HDRP(next));
     }
+
+    if (avail < size)
+      return NULL;
+
+    remove_from_list(a, next, 0);
+    cur = avail;
+    set_allocated(HDRP(ptr), PACK(cur, 1));
   }
-  else
+
+  // Split off the tail the same way arena_malloc does, merging it with
+  // a free block after it
+  if (cur - size >= MIN_BLOCK)
   {
-    if (page_head == NULL)
+    set_allocated(HDRP(ptr), PACK(size, 1));
+    rest = NEXT_BLKP(ptr);
+    set_allocated(HDRP(rest), PACK(cur - size, 0));
+    next = NEXT_BLKP(rest);
+    if (GET_ALLOC(HDRP(next)) == 0)
     {
-      page_head = ptr;
-      return;
+      remove_from_list(a, next, 0);
+      set_allocated(HDRP(rest), PACK(GET_SIZE(HDRP(rest)) + GET_SIZE(HDRP(next)), 0));
     }
+    add(a, rest, 0);
   }
 
-  list_ptr *head = page ? page_head : free_head;
-  ptr->next = head;
-  head->prev = ptr;
-  if (!page)
+  chunk->live += GET_SIZE(HDRP(ptr));
+  chunk->live -= old_size;
+  return ptr;
+}
+
+// Keeps the block's own PREV_ALLOC bit, and sets or clears the next
+// block's. When splitting, set the first part before the second, so
+// that the second part's header gets its bit.
+void set_allocated(void *b, size_t size)
+{
+  char *next = (char *)b + (size & ~0xF);
+
+  PUT(b, size | GET_PREV_ALLOC(b));
+  if (size & 0x1)
   {
-    free_head = ptr;
+    PUT(next, GET(next) | PREV_ALLOC);
   }
   else
   {
-    page_head = ptr;
+    PUT(next - 8, size);
+    PUT(next, GET(next) & ~PREV_ALLOC);
   }
 }
 
-void remove_from_list(list_ptr *ptr, int page)
+static int size_class(size_t size)
+{
+  int c;
+
+  if (size <= EXACT_LIMIT)
+    return (size - MIN_BLOCK) / ALIGNMENT;
+
+  // EXACT_LIMIT is a power of two, so (EXACT_LIMIT, 2 * EXACT_LIMIT)
+  // maps to the first power-of-two class
+  c = EXACT_CLASSES + (63 - __builtin_clzll(size)) - __builtin_ctzll(EXACT_LIMIT);
+  return (c < NUM_CLASSES) ? c : NUM_CLASSES - 1;
+}
+
+// Treap priorities are a hash of the node's address, so they need no
+// storage and the tree's shape is the same from run to run.
+#define PRIORITY(t) (((uintptr_t)(t) * 0x9E3779B97F4A7C15ULL) >> 32)
+#define NODE_SIZE(t) GET_SIZE(HDRP(t))
+
+static int tree_less(tree_node *x, tree_node *y)
+{
+  if (fit_policy == FIT_BEST && NODE_SIZE(x) != NODE_SIZE(y))
+    return NODE_SIZE(x) < NODE_SIZE(y);
+  return x < y;
+}
+
+static void tree_update(tree_node *t)
+{
+  t->max = NODE_SIZE(t);
+  if (t->left != NULL && t->left->max > t->max)
+    t->max = t->left->max;
+  if (t->right != NULL && t->right->max > t->max)
+    t->max = t->right->max;
+}
+
+static tree_node *tree_insert(tree_node *t, tree_node *n)
 {
-  // printf("Remove: %p\n", ptr);
-  if (ptr->next == NULL && ptr->prev == NULL)
+  tree_node *child;
+
+  if (t == NULL)
+  {
+    n->left = n->right = NULL;
+    tree_update(n);
+    return n;
+  }
+
+  // Rotate n up while its priority is higher than its parent's
+  if (tree_less(n, t))
   {
-    if (!page)
+    child = t->left = tree_insert(t->left, n);
+    if (PRIORITY(child) > PRIORITY(t))
     {
-      free_head = NULL;
+      t->left = child->right;
+      child->right = t;
+      tree_update(t);
+      t = child;
     }
-    else
+  }
+  else
+  {
+    child = t->right = tree_insert(t->right, n);
+    if (PRIORITY(child) > PRIORITY(t))
     {
-      page_head = NULL;
+      t->right = child->left;
+      child->left = t;
+      tree_update(t);
+      t = child;
     }
   }
-  else if (ptr->next == NULL)
+  tree_update(t);
+  return t;
+}
+
+// Joins two treaps, every node of l ordered before every node of r
+static tree_node *tree_merge(tree_node *l, tree_node *r)
+{
+  if (l == NULL)
+    return r;
+  if (r == NULL)
+    return l;
+
+  if (PRIORITY(l) > PRIORITY(r))
   {
-    ptr->prev->next = NULL;
+    l->right = tree_merge(l->right, r);
+    tree_update(l);
+    return l;
   }
-  else if (ptr->prev == NULL)
+  r->left = tree_merge(l, r->left);
+  tree_update(r);
+  return r;
+}
+
+static tree_node *tree_remove(tree_node *t, tree_node *n)
+{
+  if (t == n)
+    return tree_merge(t->left, t->right);
+
+  if (tree_less(n, t))
+    t->left = tree_remove(t->left, n);
+  else
+    t->right = tree_remove(t->right, n);
+  tree_update(t);
+  return t;
+}
+
+// The smallest block of at least `size` bytes, by (size, address)
+static tree_node *tree_best_fit(tree_node *t, size_t size)
+{
+  tree_node *best = NULL;
+
+  while (t != NULL)
   {
-    ptr->next->prev = NULL;
-    if (!page)
+    if (NODE_SIZE(t) >= size)
     {
-      free_head = ptr->next;
+      best = t;
+      t = t->left;
     }
     else
     {
-      page_head = ptr->next;
+      t = t->right;
     }
   }
+  return best;
+}
+
+// The lowest-addressed block at or after `from` of at least `size`
+// bytes. Subtrees whose `max` is too small are skipped, and only the
+// path to `from` can fail after a subtree's max says it fits, so this
+// visits O(log n) nodes.
+static tree_node *tree_first_fit(tree_node *t, size_t size, void *from)
+{
+  tree_node *found;
+
+  if (t == NULL || t->max < size)
+    return NULL;
+
+  if ((void *)t >= from)
+  {
+    if ((found = tree_first_fit(t->left, size, from)) != NULL)
+      return found;
+    if (NODE_SIZE(t) >= size)
+      return t;
+  }
+  return tree_first_fit(t->right, size, from);
+}
+
+static void *tree_find(arena_t *a, size_t size)
+{
+  tree_node *found;
+
+  switch (fit_policy)
+  {
+  case FIT_BEST:
+    return tree_best_fit(a->tree, size);
+  case FIT_ADDRESS:
+    return tree_first_fit(a->tree, size, NULL);
+  default:
+    found = tree_first_fit(a->tree, size, a->rover);
+    if (found == NULL)
+      found = tree_first_fit(a->tree, size, NULL);
+    a->rover = found;
+    return found;
+  }
+}
+
+// A free block is filed under the class of its current size, and a
+// chunk under page_head, so the header of a free block must not change
+// while it is on a list.
+void add(arena_t *a, list_ptr *ptr, int page)
+{
+  list_ptr **head;
+  int c = 0;
+
+  if (page)
+  {
+    head = &a->page_head;
+  }
   else
+  {
+    c = size_class(GET_SIZE(HDRP(ptr)));
+    if (fit_policy != FIT_FIRST && c >= EXACT_CLASSES)
+    {
+      // The first power-of-two class's bit stands for the whole treap
+      a->tree = tree_insert(a->tree, (tree_node *)ptr);
+      a->free_bitmap |= 1ULL << EXACT_CLASSES;
+      return;
+    }
+    head = &a->free_lists[c];
+    a->free_bitmap |= 1ULL << c;
+  }
+
+  ptr->prev = NULL;
+  ptr->next = *head;
+  if (*head != NULL)
+  {
+    (*head)->prev = ptr;
+  }
+  *head = ptr;
+}
+
+void remove_from_list(arena_t *a, list_ptr *ptr, int page)
+{
+  int c = page ? 0 : size_class(GET_SIZE(HDRP(ptr)));
+
+  if (!page && fit_policy != FIT_FIRST && c >= EXACT_CLASSES)
+  {
+    a->tree = tree_remove(a->tree, (tree_node *)ptr);
+    if (a->tree == NULL)
+      a->free_bitmap &= ~(1ULL << EXACT_CLASSES);
+    return;
+  }
+
+  if (ptr->prev != NULL)
   {
     ptr->prev->next = ptr->next;
+  }
+  else if (page)
+  {
+    a->page_head = ptr->next;
+  }
+  else
+  {
+    a->free_lists[c] = ptr->next;
+    if (ptr->next == NULL)
+    {
+      a->free_bitmap &= ~(1ULL << c);
+    }
+  }
+
+  if (ptr->next != NULL)
+  {
     ptr->next->prev = ptr->prev;
   }
 
   ptr->prev = NULL;
   ptr->next = NULL;
 }
-void *get_first(size_t size)
+
+void *get_first(arena_t *a, size_t size)
 {
-  list_ptr *current = free_head;
+  int c = size_class(size);
+  unsigned long long candidates;
+  list_ptr *current;
 
-  while (current != NULL && GET_SIZE(HDRP(current)) < size)
+  if (fit_policy != FIT_FIRST)
   {
-    current = current->next;
+    candidates = a->free_bitmap & (~0ULL << c) & ((1ULL << EXACT_CLASSES) - 1);
+    if (c < EXACT_CLASSES && candidates != 0)
+      return a->free_lists[__builtin_ctzll(candidates)];
+    return tree_find(a, size);
   }
 
-  return current;
+  // Blocks in a power-of-two class can be smaller than the request, so
+  // search that one class first-fit; every block in a higher class fits
+  if (c >= EXACT_CLASSES)
+  {
+    for (current = a->free_lists[c]; current != NULL; current = current->next)
+    {
+      if (GET_SIZE(HDRP(current)) >= size)
+        return current;
+    }
+    if (++c == NUM_CLASSES)
+      return NULL;
+  }
+
+  candidates = a->free_bitmap & (~0ULL << c);
+  if (candidates == 0)
+    return NULL;
+
+  return a->free_lists[__builtin_ctzll(candidates)];
 }
 
-void extend(size_t s)
+int extend(arena_t *a, size_t s)
 {
-  s = PAGE_ALIGN(s + sizeof(list_ptr) + OVERHEAD * 2);
-  size_t page_size;
+  s = PAGE_ALIGN(s + sizeof(chunk_header) + PROLOGUE + EPILOGUE + 8);
+  size_t page_size = 0;
 
   while (page_size < s)
   {
-    page_size = mapped * mem_pagesize();
-    mapped = mapped + 6;
+    page_size = a->mapped * mem_pagesize();
+    a->mapped = a->mapped + 6;
   }
 
-  void *ptr = mem_map(page_size);
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  chunk_header *chunk = mem_map(page_size);
+  if (chunk != NULL)
+    dir_set(chunk, page_size, chunk);
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
+  if (chunk == NULL)
+    return -1;
 
-  int page_header_size = sizeof(list_ptr) + OVERHEAD;
-  int page_footer_size = OVERHEAD;
-  size_t empty_size = page_size - page_header_size - page_footer_size - 16;
-  // printf("Allocated new page on %p\n", ptr);
+  size_t empty_size = page_size - sizeof(chunk_header) - PROLOGUE - EPILOGUE - 8;
+  // printf("Allocated new page on %p\n", chunk);
 
-  *(size_t *)ptr = empty_size;
-  ptr = (char *)ptr + 8;
+  chunk->arena = a;
+  chunk->size = page_size;
+  chunk->live = 0;
+  a->empty_chunks++;
+  void *ptr = chunk + 1;
 
-  set_allocated(ptr, PACK(page_header_size, 1));
-  list_ptr *list = (char *)ptr + 8;
-  add(list, 1);
+  set_allocated(ptr, PACK(PROLOGUE, 1));
+  list_ptr *list = PROLOGUEP(chunk);
+  add(a, list, 1);
 
-  void *empty_start = (char *)ptr + page_header_size;
+  void *empty_start = (char *)ptr + PROLOGUE;
 
   set_allocated(empty_start, PACK(empty_size, 0));
-  add((char *)empty_start + 8, 0);
+  add(a, (list_ptr *)((char *)empty_start + 8), 0);
+
+  set_allocated((char *)empty_start + empty_size, PACK(EPILOGUE, 1));
+  return 0;
+}
 
-  set_allocated((char *)ptr + page_size - OVERHEAD - 16, PACK(OVERHEAD, 1));
+void unmap_page(arena_t *a, chunk_header *chunk, void *bp)
+{
+  remove_from_list(a, PROLOGUEP(chunk), 1);
+  remove_from_list(a, bp, 0);
+  a->empty_chunks--;
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  mem_unmap(chunk, chunk->size);
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
 }
 
-void unmap_page()
+static void sample_site(void *site, size_t size)
 {
-  list_ptr *current = page_head;
-  int page_header_size = sizeof(list_ptr) + OVERHEAD;
-  int page_footer_size = OVERHEAD;
+  int i;
 
-  while (current != NULL)
+  if ((sample_left -= (long)size) > 0)
+    return;
+  sample_left = sample_period;
+
+#ifdef MM_THREADS
+  pthread_mutex_lock(&sites_lock);
+#endif
+  for (i = 0; i < num_sites && sites[i].site != site; i++)
+    ;
+  if (i == num_sites && num_sites < MM_STATS_SITES)
+    sites[num_sites++].site = site;
+  if (i < num_sites)
   {
-    void *page_header = (char *)current - OVERHEAD;
-    size_t empty_size = *(size_t *)page_header;
-    void *block = NEXT_BLKP(current);
-    if (GET_SIZE(HDRP(NEXT_BLKP(NEXT_BLKP(current)))) == OVERHEAD)
+    sites[i].samples++;
+    sites[i].bytes += size;
+  }
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&sites_lock);
+#endif
+}
+
+void mm_sample_sites(size_t period)
+{
+  sample_period = period;
+  sample_left = period;
+}
+
+// Adds up the blocks of one chunk. A page is used when part of an
+// allocated block lies on it; blocks are visited in address order, so
+// a page shared by two blocks is counted once.
+static void stats_chunk(mm_stats_t *st, chunk_header *chunk)
+{
+  uintptr_t last_page = 0, first, last;
+  void *bp;
+  size_t size;
+
+  for (bp = NEXT_BLKP(PROLOGUEP(chunk)); GET_SIZE(HDRP(bp)) != EPILOGUE; bp = NEXT_BLKP(bp))
+  {
+    size = GET_SIZE(HDRP(bp));
+    if (GET_ALLOC(HDRP(bp)) == 0)
     {
-      list_ptr *next = current->next;
-      remove_from_list(current, 1);
-      remove_from_list(block, 0);
-      mem_unmap(page_header, empty_size + page_header_size + page_footer_size + 16);
-      current = next;
+      st->free_bytes += size;
+      st->class_free_bytes[size_class(size)] += size;
+      if (size > st->largest_free)
+        st->largest_free = size;
       continue;
     }
-    current = current->next;
+
+    st->live_bytes += size;
+    first = (uintptr_t)HDRP(bp) >> DIR_PAGE_BITS;
+    last = ((uintptr_t)HDRP(bp) + size - 1) >> DIR_PAGE_BITS;
+    if (first <= last_page)
+      first = last_page + 1;
+    if (first <= last)
+      st->used_pages += last - first + 1;
+    last_page = last;
+  }
+}
+
+void mm_stats(mm_stats_t *st)
+{
+  list_ptr *chunk;
+  slab *s;
+  int i, c;
+
+  memset(st, 0, sizeof(*st));
+
+  for (i = 0; i < NUM_ARENAS; i++)
+  {
+    arena_t *a = &arenas[i];
+#ifdef MM_THREADS
+    pthread_mutex_lock(&a->lock);
+#endif
+    for (chunk = a->page_head; chunk != NULL; chunk = chunk->next)
+    {
+      st->chunks++;
+      stats_chunk(st, CHUNKP(chunk));
+    }
+
+    // Full slabs have no free objects to add
+    st->slabs += a->slab_count;
+    st->used_pages += a->slab_count;
+    st->live_bytes += a->slab_live;
+    for (c = 0; c < SLAB_CLASSES; c++)
+    {
+      for (s = a->slabs[c]; s != NULL; s = s->next)
+      {
+        st->slab_free_bytes += s->nfree * s->size;
+        if (s->nfree == s->capacity)
+          st->used_pages--;
+      }
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&a->lock);
+#endif
+  }
+  st->free_bytes += st->slab_free_bytes;
+
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  st->huge_blocks = huge_count;
+  st->live_bytes += huge_bytes;
+  st->used_pages += huge_bytes / mem_pagesize();
+  st->mapped_pages = mem_heapsize() / mem_pagesize();
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
+
+  if (st->free_bytes != 0)
+    st->fragmentation = 1.0 - (double)st->largest_free / st->free_bytes;
+
+#ifdef MM_THREADS
+  pthread_mutex_lock(&sites_lock);
+#endif
+  st->num_sites = num_sites;
+  memcpy(st->sites, sites, sizeof(sites));
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&sites_lock);
+#endif
+}
+
+void mm_walk(mm_walk_fn fn, void *arg)
+{
+  mm_walk_t item;
+  list_ptr *chunk;
+  chunk_header *ch;
+  slab *s;
+  list_ptr *huge;
+  void *bp;
+  int i, c;
+
+  for (i = 0; i < NUM_ARENAS; i++)
+  {
+    arena_t *a = &arenas[i];
+#ifdef MM_THREADS
+    pthread_mutex_lock(&a->lock);
+#endif
+    for (chunk = a->page_head; chunk != NULL; chunk = chunk->next)
+    {
+      ch = CHUNKP(chunk);
+      item.kind = MM_WALK_CHUNK;
+      item.addr = ch;
+      item.size = ch->size;
+      item.live = ch->live;
+      fn(&item, arg);
+
+      item.kind = MM_WALK_BLOCK;
+      for (bp = NEXT_BLKP(PROLOGUEP(ch)); GET_SIZE(HDRP(bp)) != EPILOGUE; bp = NEXT_BLKP(bp))
+      {
+        item.addr = HDRP(bp);
+        item.size = GET_SIZE(HDRP(bp));
+        item.live = GET_ALLOC(HDRP(bp)) ? item.size : 0;
+        fn(&item, arg);
+      }
+    }
+
+    item.kind = MM_WALK_SLAB;
+    item.size = mem_pagesize();
+    for (c = 0; c <= SLAB_CLASSES; c++)
+    {
+      for (s = (c < SLAB_CLASSES) ? a->slabs[c] : a->full_slabs; s != NULL; s = s->next)
+      {
+        item.addr = s;
+        item.live = (size_t)(s->capacity - s->nfree) * s->size;
+        fn(&item, arg);
+      }
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&a->lock);
+#endif
+  }
+
+  // A huge block is everything in its mapping after the list links
+#ifdef MM_THREADS
+  pthread_mutex_lock(&map_lock);
+#endif
+  for (huge = huge_head; huge != NULL; huge = huge->next)
+  {
+    bp = (char *)huge + HUGE_HEADER;
+    item.kind = MM_WALK_HUGE;
+    item.addr = huge;
+    item.size = GET_SIZE(HDRP(bp));
+    item.live = item.size - sizeof(list_ptr);
+    fn(&item, arg);
+
+    item.kind = MM_WALK_BLOCK;
+    item.addr = huge + 1;
+    item.size = item.live;
+    fn(&item, arg);
   }
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&map_lock);
+#endif
 }
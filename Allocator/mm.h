@@ -3,3 +3,69 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void *mm_realloc (void *ptr, size_t size);
+
+/* A block whose payload is aligned to `alignment`, a power of two; it
+   is freed and resized like any other */
+extern void *mm_memalign (size_t alignment, size_t size);
+
+/* Like mm_malloc, mm_realloc and mm_memalign, but the call is sampled
+   (see mm_sample_sites) as coming from `site` rather than from their
+   caller, so that a wrapper can pass on the address of its own caller */
+extern void *mm_malloc_at (size_t size, void *site);
+extern void *mm_realloc_at (void *ptr, size_t size, void *site);
+extern void *mm_memalign_at (size_t alignment, size_t size, void *site);
+
+/* Bytes that the block at ptr can hold, at least the size requested */
+extern size_t mm_usable_size (void *ptr);
+
+/* Size classes of the free lists, and callsites kept by the sampler */
+#define MM_STATS_CLASSES 64
+#define MM_STATS_SITES 16
+
+typedef struct {
+    void *site;         /* caller of the sampled allocations */
+    size_t samples;     /* number of samples taken at the site */
+    size_t bytes;       /* bytes requested by the sampled calls */
+} mm_site_t;
+
+typedef struct {
+    size_t live_bytes;  /* bytes in allocated blocks, headers included */
+    size_t free_bytes;  /* bytes in free blocks and free slab objects */
+    size_t class_free_bytes[MM_STATS_CLASSES]; /* free bytes per free-list class */
+    size_t slab_free_bytes; /* free bytes in slabs, also in free_bytes */
+    size_t largest_free;    /* largest free block */
+    double fragmentation;   /* 1 - largest_free / free_bytes */
+    size_t chunks, slabs, huge_blocks;
+    size_t mapped_pages;    /* pages mapped by the allocator */
+    size_t used_pages;      /* pages holding part of an allocated block */
+    int num_sites;
+    mm_site_t sites[MM_STATS_SITES];
+} mm_stats_t;
+
+/* Fill in a snapshot of the heap */
+extern void mm_stats (mm_stats_t *stats);
+
+/* Sample the callsite of about one mm_malloc, mm_memalign or moving
+   mm_realloc call per `period` bytes requested; 0 turns sampling off */
+extern void mm_sample_sites (size_t period);
+
+/* A part of the heap, as mm_walk reports it */
+#define MM_WALK_CHUNK 0 /* a chunk, followed by each of its blocks */
+#define MM_WALK_BLOCK 1 /* a block, from its header; live if allocated */
+#define MM_WALK_SLAB  2 /* a slab page of small objects */
+#define MM_WALK_HUGE  3 /* a huge block's mapping, followed by the block */
+
+typedef struct {
+    int kind;           /* one of MM_WALK_CHUNK to MM_WALK_HUGE */
+    void *addr;         /* where it starts */
+    size_t size;        /* its bytes, headers included */
+    size_t live;        /* bytes of it in allocated blocks or objects */
+} mm_walk_t;
+
+typedef void (*mm_walk_fn)(const mm_walk_t *item, void *arg);
+
+/* Call fn on every chunk, block, slab and huge mapping. The blocks of a
+   chunk come right after it, in address order, and so does the block
+   of a huge mapping. fn must not call into the allocator. */
+extern void mm_walk (mm_walk_fn fn, void *arg);
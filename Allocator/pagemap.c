@@ -4,98 +4,226 @@
 #include "pagemap.h"
 
 /* Keep track of all mapped pages so that we can easily get a list of
-   all of them --- but also efficiently add and remove from the list. */
+   all of them --- but also efficiently add and remove ranges of them.
 
-typedef struct mpage {
-  void *addr;
-  struct mpage *prev, *next;
-} mpage;
+   Pages are numbered by address >> LOG_APAGE_SIZE. A radix tree,
+   indexed like the hardware page tables, maps the high bits of a page
+   number to a leaf with one bit for each of LEAF_PAGES pages. Leaves
+   with any bit set are linked together so that iteration visits only
+   them, and a leaf is freed as soon as its last page is unmapped. */
 
-static mpage *all_mapped_pages;
+#define LEAF_BITS 9
+#define LEAF_PAGES (1 << LEAF_BITS)
+#define LEAF_WORDS (LEAF_PAGES / 64)
 
-static mpage ***page_maps1;
+#define NODE_BITS 9
+#define NODE_SIZE (1 << NODE_BITS)
+#define LEVELS 3 /* of nodes above the leaves, including the root */
 
-#define PAGEMAP64_LEVEL1_SIZE (1 << 16)
-#define PAGEMAP64_LEVEL2_SIZE (1 << 16)
-#define PAGEMAP64_LEVEL3_SIZE (1 << (32 - LOG_APAGE_SIZE))
-#define PAGEMAP64_LEVEL1_BITS(p) (((uintptr_t)(p)) >> 48)
-#define PAGEMAP64_LEVEL2_BITS(p) ((((uintptr_t)(p)) >> 32) & ((PAGEMAP64_LEVEL2_SIZE) - 1))
-#define PAGEMAP64_LEVEL3_BITS(p) ((((uintptr_t)(p)) >> LOG_APAGE_SIZE) & ((PAGEMAP64_LEVEL3_SIZE) - 1))
+/* Page numbers the tree can hold: 48-bit addresses */
+#define PAGE_NUM_BITS (LEAF_BITS + LEVELS * NODE_BITS)
 
-void pagemap_modify(void *p, int mapped) {
-  uintptr_t pos;
-  mpage **page_maps2;
-  mpage *page_maps3;
-  mpage *page;
+typedef struct leaf {
+  uintptr_t first;            /* page number of bit 0 */
+  struct leaf *prev, *next;
+  int count;                  /* bits set */
+  uint64_t bits[LEAF_WORDS];
+} leaf;
 
-  if (!page_maps1) {
-    page_maps1 = calloc(PAGEMAP64_LEVEL1_SIZE, sizeof(mpage **));
+static void *root[NODE_SIZE];
+static leaf *all_leaves;
+
+/* Bytes of nodes and leaves, the root included */
+static size_t footprint = sizeof(root), peak_footprint = sizeof(root);
+
+static void grow_footprint(size_t n) {
+  footprint += n;
+  if (footprint > peak_footprint)
+    peak_footprint = footprint;
+}
+
+/* Returns the slot of the leaf for `page`, or NULL if there is none and
+   `create` is not set. Inner nodes are never freed. */
+static leaf **find_leaf(uintptr_t page, int create) {
+  void **node = root, **child;
+  int shift;
+
+  if (page >> PAGE_NUM_BITS) {
+    if (!create) return NULL;
+    fprintf(stderr, "internal error: page %p is out of range\n",
+            (void *)(page << LOG_APAGE_SIZE));
+    abort();
   }
 
-  pos = PAGEMAP64_LEVEL1_BITS(p);
-  page_maps2 = page_maps1[pos];
-  if (!page_maps2) {
-    page_maps2 = calloc(PAGEMAP64_LEVEL2_SIZE, sizeof(mpage *));
-    page_maps1[pos] = page_maps2;
+  for (shift = PAGE_NUM_BITS - NODE_BITS; shift > LEAF_BITS; shift -= NODE_BITS) {
+    child = (void **)&node[(page >> shift) & (NODE_SIZE - 1)];
+    if (!*child) {
+      if (!create) return NULL;
+      if (!(*child = calloc(NODE_SIZE, sizeof(void *)))) {
+        fprintf(stderr, "internal error: cannot allocate pagemap node\n");
+        abort();
+      }
+      grow_footprint(NODE_SIZE * sizeof(void *));
+    }
+    node = *child;
   }
-  
-  pos = PAGEMAP64_LEVEL2_BITS(p);
-  page_maps3 = page_maps2[pos];
-  if (!page_maps3) {
-    page_maps3 = calloc(PAGEMAP64_LEVEL3_SIZE, sizeof(mpage));
-    page_maps2[pos] = page_maps3;
+
+  return (leaf **)&node[(page >> LEAF_BITS) & (NODE_SIZE - 1)];
+}
+
+static leaf *new_leaf(leaf **slot, uintptr_t page) {
+  leaf *l = calloc(1, sizeof(leaf));
+
+  if (!l) {
+    fprintf(stderr, "internal error: cannot allocate pagemap leaf\n");
+    abort();
   }
+  grow_footprint(sizeof(leaf));
 
-  page = &page_maps3[PAGEMAP64_LEVEL3_BITS(p)];
+  l->first = page & ~(uintptr_t)(LEAF_PAGES - 1);
+  l->next = all_leaves;
+  if (all_leaves)
+    all_leaves->prev = l;
+  all_leaves = l;
+  *slot = l;
+  return l;
+}
+
+static void free_leaf(leaf **slot) {
+  leaf *l = *slot;
+
+  if (l->prev)
+    l->prev->next = l->next;
+  else
+    all_leaves = l->next;
+  if (l->next)
+    l->next->prev = l->prev;
+
+  *slot = NULL;
+  free(l);
+  footprint -= sizeof(leaf);
+}
 
-  if (mapped) {
-    if (page->addr) {
-      fprintf(stderr, "internal error: page is already mapped\n");
-      abort();
+/* Bits lo to hi - 1 of a word, where lo < hi <= 64 */
+static uint64_t word_mask(unsigned lo, unsigned hi) {
+  return ((hi == 64) ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+}
+
+void pagemap_modify_range(void *addr, size_t size, int mapped) {
+  uintptr_t page = (uintptr_t)addr >> LOG_APAGE_SIZE;
+  uintptr_t end = page + (size >> LOG_APAGE_SIZE);
+  uintptr_t stop;
+  unsigned i, j, hi;
+  uint64_t mask;
+  leaf **slot;
+  leaf *l;
+
+  while (page < end) {
+    slot = find_leaf(page, mapped);
+    l = slot ? *slot : NULL;
+    if (!l) {
+      if (!mapped) {
+        fprintf(stderr, "internal error: not currently mapped\n");
+        abort();
+      }
+      l = new_leaf(slot, page);
     }
-    if (page == all_mapped_pages)
-      abort();
-    page->addr = p;
-    page->prev = NULL;
-    page->next = all_mapped_pages;
-    if (all_mapped_pages)
-      all_mapped_pages->prev = page;
-    all_mapped_pages = page;
-  } else {
-    if (!page->addr) {
-      fprintf(stderr, "internal error: not currently mapped\n");
-      abort();
+
+    /* The part of the range that falls in this leaf */
+    stop = l->first + LEAF_PAGES;
+    if (stop > end)
+      stop = end;
+
+    for (i = page - l->first, j = stop - l->first; i < j; i = hi) {
+      hi = (i | 63) + 1;
+      if (hi > j)
+        hi = j;
+      mask = word_mask(i % 64, hi - (i & ~63u));
+      if (mapped) {
+        if (l->bits[i / 64] & mask) {
+          fprintf(stderr, "internal error: page is already mapped\n");
+          abort();
+        }
+        l->bits[i / 64] |= mask;
+        l->count += __builtin_popcountll(mask);
+      } else {
+        if ((l->bits[i / 64] & mask) != mask) {
+          fprintf(stderr, "internal error: not currently mapped\n");
+          abort();
+        }
+        l->bits[i / 64] &= ~mask;
+        l->count -= __builtin_popcountll(mask);
+      }
     }
-    page->addr = NULL;
-    if (page->prev)
-      page->prev->next = page->next;
-    else
-      all_mapped_pages = page->next;
-    if (page->next)
-      page->next->prev = page->prev;
+
+    if (l->count == 0)
+      free_leaf(slot);
+    page = stop;
+  }
+}
+
+void pagemap_modify(void *addr, int mapped) {
+  pagemap_modify_range(addr, APAGE_SIZE, mapped);
+}
+
+int pagemap_is_mapped(void *addr) {
+  uintptr_t page = (uintptr_t)addr >> LOG_APAGE_SIZE;
+  leaf **slot = find_leaf(page, 0);
+  unsigned i;
+
+  if (!slot || !*slot) return 0;
+  i = page & (LEAF_PAGES - 1);
+  return ((*slot)->bits[i / 64] >> (i % 64)) & 1;
+}
+
+void *pagemap_first_unmapped(void *addr, size_t size) {
+  uintptr_t page = (uintptr_t)addr >> LOG_APAGE_SIZE;
+  uintptr_t end = page + (size >> LOG_APAGE_SIZE);
+  leaf **slot;
+  unsigned i;
+
+  for (; page < end; page++) {
+    slot = find_leaf(page, 0);
+    if (!slot || !*slot)
+      return (void *)(page << LOG_APAGE_SIZE);
+    i = page & (LEAF_PAGES - 1);
+    if (!(((*slot)->bits[i / 64] >> (i % 64)) & 1))
+      return (void *)(page << LOG_APAGE_SIZE);
   }
+
+  return NULL;
 }
 
-int pagemap_is_mapped(void *p) {
-  mpage **page_maps2;
-  mpage *page_maps3;
+/* Returns the first bit at or after i that is set (or clear, if `set`
+   is 0), or LEAF_PAGES if there is none. */
+static unsigned next_bit(leaf *l, unsigned i, int set) {
+  uint64_t w;
+
+  while (i < LEAF_PAGES) {
+    w = set ? l->bits[i / 64] : ~l->bits[i / 64];
+    w &= ~0ULL << (i % 64);
+    if (w)
+      return (i & ~63u) + __builtin_ctzll(w);
+    i = (i & ~63u) + 64;
+  }
 
-  if (!page_maps1) return 0;
-  page_maps2 = page_maps1[PAGEMAP64_LEVEL1_BITS(p)];
-  if (!page_maps2) return 0;
-  page_maps3 = page_maps2[PAGEMAP64_LEVEL2_BITS(p)];
-  if (!page_maps3) return 0;
-  return !!page_maps3[PAGEMAP64_LEVEL3_BITS(p)].addr;
+  return LEAF_PAGES;
 }
 
 void pagemap_for_each(page_callback f) {
-  mpage *p, *next;
-  p = all_mapped_pages;
-  while (p) {
-    next = p->next;
-    f(p->addr);
-    pagemap_modify(p->addr, 0);
-    p = next;
+  leaf *l, *next;
+  unsigned i, j;
+
+  for (l = all_leaves; l; l = next) {
+    next = l->next;
+    for (i = next_bit(l, 0, 1); i < LEAF_PAGES; i = next_bit(l, j, 1)) {
+      j = next_bit(l, i, 0);
+      f((void *)((l->first + i) << LOG_APAGE_SIZE), (size_t)(j - i) << LOG_APAGE_SIZE);
+    }
+    free_leaf(find_leaf(l->first, 0));
   }
-  all_mapped_pages = NULL;
+}
+
+size_t pagemap_peak_footprint(void) {
+  return peak_footprint;
 }
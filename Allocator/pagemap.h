@@ -1,9 +1,14 @@
+#include <stddef.h>
 
-typedef void (*page_callback)(void *addr);
+/* Called with each run of consecutive mapped pages */
+typedef void (*page_callback)(void *addr, size_t size);
 
 void pagemap_modify(void *addr, int mapped);
+void pagemap_modify_range(void *addr, size_t size, int mapped);
 int pagemap_is_mapped(void *addr);
+void *pagemap_first_unmapped(void *addr, size_t size);
 void pagemap_for_each(page_callback f);
+size_t pagemap_peak_footprint(void);
 
 /* APAGE_SIZE needs to match the actual page size */
 #define LOG_APAGE_SIZE 12
@@ -0,0 +1,77 @@
+/*
+ * rep2bin - convert an ASCII .rep trace to the binary format that
+ *     mdriver can map and stream (see tracefmt.h)
+ *
+ * usage: rep2bin <in.rep> <out>
+ *
+ * Requests are converted one at a time, so traces of any size can be
+ * converted in constant memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024
+
+static void die(char *msg, char *path)
+{
+    fprintf(stderr, "rep2bin: %s: %s\n", path, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_header_t h;
+    char type[MAXLINE];
+    unsigned char buf[TRACE_MAX_OP];
+    unsigned index, size, num_ops = 0;
+    int op;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: rep2bin <in.rep> <out>\n");
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die("cannot open", argv[1]);
+    if ((out = fopen(argv[2], "wb")) == NULL)
+        die("cannot create", argv[2]);
+
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    if (fscanf(in, "%u %u %u %u", &h.sugg_heapsize, &h.num_ids,
+               &h.num_ops, &h.weight) != 4)
+        die("bad trace header", argv[1]);
+    fwrite(&h, sizeof(h), 1, out);
+
+    while (fscanf(in, "%s", type) != EOF) {
+        size = 0;
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(in, "%u %u", &index, &size) != 2)
+                die("bad request", argv[1]);
+            op = (type[0] == 'a') ? TRACE_ALLOC : TRACE_REALLOC;
+            break;
+        case 'f':
+            if (fscanf(in, "%u", &index) != 1)
+                die("bad request", argv[1]);
+            op = TRACE_FREE;
+            break;
+        default:
+            die("bogus request type", argv[1]);
+        }
+        if (index >= h.num_ids || index >= (1u << 30))
+            die("request index out of range", argv[1]);
+        fwrite(buf, trace_encode_op(buf, op, index, size), 1, out);
+        num_ops++;
+    }
+
+    if (num_ops != h.num_ops)
+        die("request count does not match the header", argv[1]);
+    if (fclose(out) != 0)
+        die("write failed", argv[2]);
+    fclose(in);
+    return 0;
+}
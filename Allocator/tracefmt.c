@@ -0,0 +1,25 @@
+/*
+ * tracefmt.c - encoder for binary trace files (see tracefmt.h)
+ */
+#include "tracefmt.h"
+
+static size_t put_varint(unsigned char *buf, unsigned v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+size_t trace_encode_op(unsigned char *buf, int type, unsigned index, unsigned size)
+{
+    size_t n = put_varint(buf, (index << 2) | type);
+
+    if (type != TRACE_FREE)
+        n += put_varint(buf + n, size);
+    return n;
+}
@@ -0,0 +1,80 @@
+/*
+ * tracefmt.h - binary trace files
+ *
+ * A binary trace is a trace_header_t followed by the trace's requests,
+ * each encoded as one varint holding (index << 2) | type and, for an
+ * alloc or realloc, a second varint holding the size. A varint is
+ * little-endian base 128: 7 bits per byte, with the high bit set on
+ * every byte but the last. Header fields are in host byte order.
+ */
+#ifndef __TRACEFMT_H_
+#define __TRACEFMT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+
+/* Request types; these match the order of mdriver's traceop_t */
+#define TRACE_ALLOC   0
+#define TRACE_FREE    1
+#define TRACE_REALLOC 2
+
+/* Most bytes one request can take: two 32-bit varints */
+#define TRACE_MAX_OP 10
+
+typedef struct {
+    char magic[8];          /* TRACE_MAGIC, without its NUL */
+    uint32_t sugg_heapsize; /* the .rep header fields, in order */
+    uint32_t num_ids;
+    uint32_t num_ops;
+    uint32_t weight;
+} trace_header_t;
+
+/* Encodes a request at buf and returns the number of bytes used */
+size_t trace_encode_op(unsigned char *buf, int type, unsigned index, unsigned size);
+
+/* Reads the varint at p into v and returns a pointer just past it, or
+   NULL if it runs to end or is too long for 32 bits */
+static inline const unsigned char *trace_get_varint(const unsigned char *p,
+                                                    const unsigned char *end,
+                                                    unsigned *v)
+{
+    unsigned x = 0;
+    int shift = 0;
+
+    for (;;) {
+        if (p == end || shift > 28)
+            return NULL;
+        if (!(*p & 0x80))
+            break;
+        x |= (unsigned)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = x | ((unsigned)*p++ << shift);
+    return p;
+}
+
+/* 
+ * Decodes the request at p, which must end before end, and returns a
+ * pointer just past it, or NULL if it is cut off. This is inline
+ * because mdriver calls it once per request in its timed loops. A free
+ * has size 0.
+ */
+static inline const unsigned char *trace_decode_op(const unsigned char *p,
+                                                   const unsigned char *end, int *type,
+                                                   unsigned *index, unsigned *size)
+{
+    unsigned tag;
+
+    if ((p = trace_get_varint(p, end, &tag)) == NULL)
+        return NULL;
+    *type = tag & 3;
+    *index = tag >> 2;
+    *size = 0;
+    if (*type != TRACE_FREE)
+        p = trace_get_varint(p, end, size);
+    return p;
+}
+
+#endif /* __TRACEFMT_H_ */
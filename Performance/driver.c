@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <math.h>
 #include "fcyc.h"
+#include "perfctr.h"
 #include "defs.h"
 #include "config.h"
 
@@ -50,6 +51,7 @@ typedef struct {
     motion_test_func motion_funct; /* The test function */
   };
     double cpes[DIM_CNT]; /* One CPE result for each dimension */
+    double events[DIM_CNT][PC_EVENTS]; /* Hardware events per element (-P) */
     char *description;    /* ASCII description of the test function */
     unsigned short valid; /* The function is tested if this is non zero */
 } bench_t;
@@ -96,6 +98,7 @@ char *motion_maxmean_desc = NULL;
 
 int save_test_image_files;
 int save_all_image_files;
+int count_events; /* Count hardware events in each test function (-P) */
 
 
 /******************** Functions begin *************************/
@@ -469,6 +472,50 @@ void motion_wrapper(void *arglist[])
     return;
 }
 
+/*
+ * count_events_per_element - Run a test function once more under the
+ *     hardware counters and store its events per element in events,
+ *     with -1 for those that could not be counted
+ */
+static void count_events_per_element(test_funct_v wrapper, void *arglist[],
+				     double work, double *events)
+{
+    double counts[PC_EVENTS];
+    int e;
+
+    fcyc_v_count(wrapper, arglist, counts);
+    for (e = 0; e < PC_EVENTS; e++)
+	events[e] = (counts[e] < 0) ? -1 : counts[e]/work;
+}
+
+/*
+ * print_events - Print a row of the results table for each hardware
+ *     event, and one for instructions per cycle
+ */
+static void print_events(double events[][PC_EVENTS])
+{
+    int i, e;
+
+    for (e = 0; e < PC_EVENTS; e++) {
+	printf("%s/el", perfctr_name(e));
+	for (i = 0; i < DIM_CNT; i++) {
+	    if (events[i][e] < 0)
+		printf("\t-");
+	    else
+		printf("\t%.2f", events[i][e]);
+	}
+	printf("\n");
+    }
+    printf("IPC\t");
+    for (i = 0; i < DIM_CNT; i++) {
+	if (events[i][PC_CYCLES] > 0 && events[i][PC_INSTRUCTIONS] >= 0)
+	    printf("\t%.2f", events[i][PC_INSTRUCTIONS]/events[i][PC_CYCLES]);
+	else
+	    printf("\t-");
+    }
+    printf("\n");
+}
+
 void run_complex_benchmark(int idx, int dim)
 {
   benchmarks_complex[idx].complex_funct(dim, orig, result);
@@ -528,6 +575,9 @@ void test_complex(int bench_index)
 	    num_cycles = fcyc_v((test_funct_v)&complex_wrapper, arglist); 
 	    cpe = num_cycles/work;
 	    benchmarks_complex[bench_index].cpes[test_num] = cpe;
+	    if (count_events)
+		count_events_per_element((test_funct_v)&complex_wrapper, arglist, work,
+					 benchmarks_complex[bench_index].events[test_num]);
 	}
     }
 
@@ -552,6 +602,9 @@ void test_complex(int bench_index)
     }
     printf("\n");
 
+    if (count_events)
+	print_events(benchmarks_complex[bench_index].events);
+
     /* Compute Speedup */
     {
 	double prod, ratio, mean;
@@ -645,6 +698,9 @@ void test_motion(int bench_index)
             num_cycles = fcyc_v((test_funct_v)&motion_wrapper, arglist); 
 	    cpe = num_cycles/work;
 	    benchmarks_motion[bench_index].cpes[test_num] = cpe;
+	    if (count_events)
+		count_events_per_element((test_funct_v)&motion_wrapper, arglist, work,
+					 benchmarks_motion[bench_index].events[test_num]);
 	}
     }
 
@@ -667,6 +723,9 @@ void test_motion(int bench_index)
     }
     printf("\n");
 
+    if (count_events)
+	print_events(benchmarks_motion[bench_index].events);
+
     /* Compute speedup */
     {
 	double prod, ratio, mean;
@@ -700,7 +759,7 @@ void test_motion(int bench_index)
 
 void usage(char *progname) 
 {
-    fprintf(stderr, "Usage: %s [-hqg] [-f <func_file>] [-d <dump_file>]\n", progname);    
+    fprintf(stderr, "Usage: %s [-hqgP] [-f <func_file>] [-d <dump_file>]\n", progname);    
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h         Print this message\n");
     fprintf(stderr, "  -i         Save test images as \".image\" files\n");
@@ -708,6 +767,7 @@ void usage(char *progname)
     fprintf(stderr, "  -m <mode>  Pick original image: gradient, squares, lines, or random\n");
     fprintf(stderr, "  -q         Quit after dumping (use with -d )\n");
     fprintf(stderr, "  -g         Autograder mode: checks only complex() and motion()\n");
+    fprintf(stderr, "  -P         Count hardware events per element\n");
     fprintf(stderr, "  -f <file>  Get test function names from dump file <file>\n");
     fprintf(stderr, "  -d <file>  Emit a dump file <file> for later use with -f\n");
     exit(EXIT_FAILURE);
@@ -731,7 +791,7 @@ int main(int argc, char *argv[])
     register_motion_functions();
 
     /* parse command line args */
-    while ((c = getopt(argc, argv, "iIm:tgqf:d:s:h")) != -1)
+    while ((c = getopt(argc, argv, "iIm:tgqPf:d:s:h")) != -1)
 	switch (c) {
 
         case 'i':
@@ -773,6 +833,10 @@ int main(int argc, char *argv[])
 	    quit_after_dump = 1;
 	    break;
 
+	case 'P': /* count hardware events while running each function */
+	    count_events = (perfctr_init() > 0);
+	    break;
+
 	case 'f': /* get names of benchmark functions from this file */
 	    bench_func_file = strdup(optarg);
 	    break;
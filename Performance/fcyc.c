@@ -5,6 +5,7 @@
 
 #include "clock.h"
 #include "fcyc.h"
+#include "perfctr.h"
 
 #define K 3
 #define MAXSAMPLES 20
@@ -197,6 +198,18 @@ double fcyc_v(test_funct_v f, void *params[])
 
 
 
+/* Run f once as fcyc_v times it, and count the hardware events it
+   causes (see perfctr.h) into counts */
+void fcyc_v_count(test_funct_v f, void *params[], double *counts)
+{
+  if (clear_cache)
+    clear();
+  perfctr_start();
+  f(params);
+  perfctr_stop(counts);
+}
+
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -11,6 +11,10 @@ typedef void (*test_funct_v)(void *);
 double fcyc(test_funct f, int* params);
 double fcyc_v(test_funct_v f, void* params[]);
 
+/* Run f once, clearing the cache first if fcyc would, and store the
+   counts of hardware events (see perfctr.h) in counts */
+void fcyc_v_count(test_funct_v f, void *params[], double *counts);
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -0,0 +1,130 @@
+/*
+ * perfctr.c - hardware event counters, read with perf_event_open(2)
+ *
+ * Only user-mode events are counted, which is all that an unprivileged
+ * process may count when kernel.perf_event_paranoid is 2. Threads the
+ * process starts after perfctr_init are counted too, once they exit. On systems
+ * other than Linux nothing can be counted.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "perfctr.h"
+
+static const char *names[PC_EVENTS] = {
+    "cycles", "instrs", "L1d miss", "LLC miss", "dTLB miss", "br miss"
+};
+
+#ifdef __linux__
+static int fds[PC_EVENTS] = {-1, -1, -1, -1, -1, -1};
+
+#define CACHE_EVENT(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PC_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+int perfctr_init(void)
+{
+    struct perf_event_attr attr;
+    int i, opened = 0, err = 0;
+
+    for (i = 0; i < PC_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            opened++;
+            continue;
+        }
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if ((fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) >= 0)
+            opened++;
+        else if (err == 0)
+            err = errno;
+    }
+
+    if (opened == 0) {
+        fprintf(stderr, "Hardware counters unavailable: %s", strerror(err));
+        if (err == EACCES || err == EPERM)
+            fprintf(stderr, " (see /proc/sys/kernel/perf_event_paranoid)");
+        else if (err == ENOENT || err == EOPNOTSUPP)
+            fprintf(stderr, " (no counters on this CPU or virtual machine)");
+        fprintf(stderr, "\n");
+    }
+    return opened;
+}
+
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PC_EVENTS; i++)
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void perfctr_stop(double *counts)
+{
+    uint64_t value[3]; /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PC_EVENTS; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < PC_EVENTS; i++) {
+        counts[i] = -1;
+        if (fds[i] < 0 || read(fds[i], value, sizeof(value)) != sizeof(value)
+            || value[2] == 0)
+            continue;
+        counts[i] = (double)value[0] * value[1] / value[2];
+    }
+}
+#else
+int perfctr_init(void)
+{
+    fprintf(stderr, "Hardware counters unavailable on this system\n");
+    return 0;
+}
+
+void perfctr_start(void)
+{
+}
+
+void perfctr_stop(double *counts)
+{
+    int i;
+
+    for (i = 0; i < PC_EVENTS; i++)
+        counts[i] = -1;
+}
+#endif
+
+const char *perfctr_name(int event)
+{
+    return names[event];
+}
@@ -0,0 +1,37 @@
+/*
+ * perfctr.h - hardware event counters, read with perf_event_open(2)
+ *
+ * Each event has a counter of its own rather than being in a group,
+ * so that an event the CPU lacks does not take the others with it.
+ * If the kernel has to share the hardware counters between events,
+ * each count is scaled up by the time its event was counted.
+ */
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+enum {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_L1D_MISSES,
+    PC_LLC_MISSES,
+    PC_DTLB_MISSES,
+    PC_BRANCH_MISSES,
+    PC_EVENTS
+};
+
+/* Open a counter of user-mode events in this process for every event
+   that can be counted. Returns how many could; if none, says why on
+   stderr. */
+int perfctr_init(void);
+
+/* Short name of an event, for table headings */
+const char *perfctr_name(int event);
+
+/* Reset and start the counters */
+void perfctr_start(void);
+
+/* Stop the counters, and store each event's count in counts[event],
+   or -1 if the event could not be counted */
+void perfctr_stop(double *counts);
+
+#endif /* __PERFCTR_H_ */
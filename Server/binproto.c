@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+#include "binproto.h"
+
+void bp_buf_init(bp_buf_t *b) {
+  b->data = NULL;
+  b->len = 0;
+  b->alloc = 0;
+}
+
+void bp_buf_free(bp_buf_t *b) {
+  free(b->data);
+  bp_buf_init(b);
+}
+
+static void ensure(bp_buf_t *b, size_t more) {
+  if (b->len + more > b->alloc) {
+    while (b->len + more > b->alloc)
+      b->alloc = 2 * (b->alloc + 32);
+    b->data = realloc(b->data, b->alloc);
+  }
+}
+
+void bp_put_byte(bp_buf_t *b, int v) {
+  ensure(b, 1);
+  b->data[b->len++] = (unsigned char)v;
+}
+
+void bp_put_varint(bp_buf_t *b, unsigned long v) {
+  ensure(b, 10);
+  while (v >= 0x80) {
+    b->data[b->len++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  b->data[b->len++] = (unsigned char)v;
+}
+
+void bp_put_string(bp_buf_t *b, const char *s, size_t len) {
+  bp_put_varint(b, len);
+  ensure(b, len);
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+}
+
+size_t bp_begin_frame(bp_buf_t *b) {
+  size_t start = b->len;
+  ensure(b, 4);
+  b->len += 4;
+  return start;
+}
+
+void bp_end_frame(bp_buf_t *b, size_t start) {
+  size_t len = b->len - start - 4;
+  b->data[start] = (len >> 24) & 0xFF;
+  b->data[start+1] = (len >> 16) & 0xFF;
+  b->data[start+2] = (len >> 8) & 0xFF;
+  b->data[start+3] = len & 0xFF;
+}
+
+void bp_reader_init(bp_reader_t *r, const void *data, size_t len) {
+  r->p = data;
+  r->end = r->p + len;
+}
+
+int bp_get_byte(bp_reader_t *r, int *v) {
+  if (r->p >= r->end)
+    return 0;
+  *v = *r->p++;
+  return 1;
+}
+
+int bp_get_varint(bp_reader_t *r, unsigned long *v) {
+  unsigned long result = 0;
+  int shift;
+
+  for (shift = 0; shift < 64; shift += 7) {
+    if (r->p >= r->end)
+      return 0;
+    result |= (unsigned long)(*r->p & 0x7F) << shift;
+    if (!(*r->p++ & 0x80)) {
+      *v = result;
+      return 1;
+    }
+  }
+
+  return 0; /* too many continuation bytes */
+}
+
+int bp_get_string(bp_reader_t *r, const char **s, size_t *len) {
+  unsigned long n;
+
+  if (!bp_get_varint(r, &n) || (n > (size_t)(r->end - r->p)))
+    return 0;
+  *s = (const char *)r->p;
+  *len = n;
+  r->p += n;
+  return 1;
+}
+
+ssize_t bp_read_frame(rio_t *rp, bp_buf_t *b, long deadline) {
+  unsigned char hdr[4];
+  size_t len;
+  ssize_t n;
+
+  n = rio_readnb_deadline(rp, hdr, 4, deadline);
+  if (n == 0)
+    return 0;
+  if (n != 4)
+    return -1;
+
+  len = ((size_t)hdr[0] << 24) | ((size_t)hdr[1] << 16)
+        | ((size_t)hdr[2] << 8) | hdr[3];
+  if ((len == 0) || (len > BP_MAX_FRAME))
+    return -1;
+
+  b->len = 0;
+  ensure(b, len);
+  if (rio_readnb_deadline(rp, b->data, len, deadline) != len)
+    return -1;
+  b->len = len;
+
+  return len;
+}
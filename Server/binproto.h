@@ -0,0 +1,86 @@
+/* A compact, length-prefixed binary protocol for friendlist clients
+   that do not want to pay for HTTP framing and query encoding.
+
+   Every message is a frame:
+
+      u32 length (big-endian, not counting these four bytes)
+      payload of `length` bytes
+
+   A request payload is
+
+      varint id | u8 op | string user | varint count | count * string
+
+   and a response payload is
+
+      varint id | u8 status | varint count | count * string
+
+   where a string is a varint byte length followed by that many bytes
+   (no terminator) and a varint is little-endian base-128 with the
+   high bit of each byte meaning "more bytes follow". The `id` is
+   chosen by the client and echoed in the response, so a client can
+   pipeline any number of requests over one connection and match up
+   responses by id. */
+
+#ifndef __BINPROTO_H__
+#define __BINPROTO_H__
+
+#include "csapp.h"
+
+/* Request op codes: */
+#define BP_OP_FRIENDS   1  /* no names; respond with user's friends */
+#define BP_OP_BEFRIEND  2  /* names to add; respond with user's friends */
+#define BP_OP_UNFRIEND  3  /* names to remove; respond with user's friends */
+#define BP_OP_MUTUAL    4  /* one name; respond with friends in common */
+
+/* Response status codes: */
+#define BP_STATUS_OK        0
+#define BP_STATUS_BAD_OP    1
+#define BP_STATUS_BAD_FRAME 2
+
+/* Frames larger than this are rejected instead of buffered: */
+#define BP_MAX_FRAME (1 << 20)
+
+/* A growable byte buffer for assembling frames: */
+typedef struct {
+  unsigned char *data;
+  size_t len, alloc;
+} bp_buf_t;
+
+void bp_buf_init(bp_buf_t *b);
+void bp_buf_free(bp_buf_t *b);
+
+/* Appends to the buffer, growing it as needed: */
+void bp_put_byte(bp_buf_t *b, int v);
+void bp_put_varint(bp_buf_t *b, unsigned long v);
+void bp_put_string(bp_buf_t *b, const char *s, size_t len);
+
+/* Appends a placeholder frame length to the buffer and records where
+   it is; bp_end_frame() fills in the length of everything appended
+   since the matching bp_begin_frame(). Several frames can be
+   assembled back-to-back in one buffer and sent with one write. */
+size_t bp_begin_frame(bp_buf_t *b);
+void bp_end_frame(bp_buf_t *b, size_t start);
+
+/* A cursor for decoding one payload in place: */
+typedef struct {
+  const unsigned char *p, *end;
+} bp_reader_t;
+
+void bp_reader_init(bp_reader_t *r, const void *data, size_t len);
+
+/* Each decoder returns 1 on success and 0 if the payload is
+   truncated or malformed. A decoded string points into the payload
+   and is not NUL-terminated. */
+int bp_get_byte(bp_reader_t *r, int *v);
+int bp_get_varint(bp_reader_t *r, unsigned long *v);
+int bp_get_string(bp_reader_t *r, const char **s, size_t *len);
+
+/* Reads one frame's payload into `b` (replacing its contents) and
+   returns the payload length, 0 on a clean EOF between frames, or -1
+   on an I/O error, a truncated frame, an empty frame (every valid
+   message has at least an id), or a frame larger than BP_MAX_FRAME.
+   The whole frame must arrive by `deadline` (see rio_deadline; 0 for
+   no limit), or it fails with errno ETIMEDOUT. */
+ssize_t bp_read_frame(rio_t *rp, bp_buf_t *b, long deadline);
+
+#endif /* __BINPROTO_H__ */
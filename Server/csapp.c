@@ -1,4 +1,7 @@
 /* 
+ * Updated 10/26:
+ *   - add deadline-aware rio_..._deadline() and open_clientfd_deadline()
+ *
  * Updated 11/16 mflatt: 
  *   - work without and wthout -pthread.
  *   - add Pipe()
@@ -924,20 +927,88 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_deadline - Return the deadline that is timeout_ms from now, in
+ *    milliseconds on the monotonic clock
+ */
+long rio_deadline(int timeout_ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + timeout_ms;
+}
+
+/*
+ * rio_wait - Wait until fd is ready for events or the deadline passes.
+ *    Returns 0 when ready, or -1 with errno set (ETIMEDOUT on expiry).
+ */
+static int rio_wait(int fd, short events, long deadline)
+{
+    struct pollfd pfd;
+    long remaining;
+    int rc;
+
+    if (!deadline)
+	return 0;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while (1) {
+	remaining = deadline - rio_deadline(0);
+	if (remaining <= 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	if ((rc = poll(&pfd, 1, (int)remaining)) > 0)
+	    return 0;
+	if ((rc < 0) && (errno != EINTR))
+	    return -1;
+    }
+}
+
+/*
+ * rio_writen_deadline - Robustly write n bytes (unbuffered), giving
+ *    up at deadline
+ */
+ssize_t rio_writen_deadline(int fd, void *usrbuf, size_t n, long deadline)
+{
+    size_t nleft = n;
+    ssize_t nwritten;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+	if (rio_wait(fd, POLLOUT, deadline) < 0)
+	    return -1;
+	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
+	    if (errno == EINTR)
+		nwritten = 0;
+	    else
+		return -1;
+	}
+	nleft -= nwritten;
+	bufp += nwritten;
+    }
+    return n;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() if the internal buffer is empty, first waiting for input
+ *    until the deadline (if any).
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n, long deadline)
 {
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	if (rio_wait(rp->rio_fd, POLLIN, deadline) < 0)
+	    return -1;
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
@@ -978,13 +1049,23 @@ void rio_readinitb(rio_t *rp, int fd)
  */
 /* $begin rio_readnb */
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    return rio_readnb_deadline(rp, usrbuf, n, 0);
+}
+/* $end rio_readnb */
+
+/*
+ * rio_readnb_deadline - Robustly read n bytes (buffered), giving up
+ *    at deadline
+ */
+ssize_t rio_readnb_deadline(rio_t *rp, void *usrbuf, size_t n, long deadline)
 {
     size_t nleft = n;
     ssize_t nread;
     char *bufp = usrbuf;
     
     while (nleft > 0) {
-	if ((nread = rio_read(rp, bufp, nleft)) < 0) 
+	if ((nread = rio_read(rp, bufp, nleft, deadline)) < 0) 
             return -1;          /* errno set by read() */ 
 	else if (nread == 0)
 	    break;              /* EOF */
@@ -993,19 +1074,29 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     }
     return (n - nleft);         /* return >= 0 */
 }
-/* $end rio_readnb */
 
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
+{
+    return rio_readlineb_deadline(rp, usrbuf, maxlen, 0);
+}
+/* $end rio_readlineb */
+
+/*
+ * rio_readlineb_deadline - Robustly read a text line (buffered),
+ *    giving up at deadline
+ */
+ssize_t rio_readlineb_deadline(rio_t *rp, void *usrbuf, size_t maxlen,
+                               long deadline)
 {
     int n, rc;
     char c, *bufp = usrbuf;
 
     for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
+        if ((rc = rio_read(rp, &c, 1, deadline)) == 1) {
 	    *bufp++ = c;
 	    if (c == '\n') {
                 n++;
@@ -1024,7 +1115,6 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     *bufp = '\0';
     return n-1;
 }
-/* $end rio_readlineb */
 
 /**********************************
  * Wrappers for robust I/O routines
@@ -1114,6 +1204,70 @@ int open_clientfd(char *hostname, char *port) {
 }
 /* $end open_clientfd */
 
+/*
+ * connect_deadline - connect() that waits no later than deadline
+ */
+static int connect_deadline(int fd, struct sockaddr *addr, socklen_t len,
+                            long deadline)
+{
+    int flags, err;
+    socklen_t errlen = sizeof(err);
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    if (connect(fd, addr, len) < 0) {
+        if (errno != EINPROGRESS)
+            return -1;
+        if (rio_wait(fd, POLLOUT, deadline) < 0)
+            return -1;
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            return -1;
+        if (err) {
+            errno = err;
+            return -1;
+        }
+    }
+
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * open_clientfd_deadline - open_clientfd, but each connect attempt
+ *     gives up at deadline. On error, returns -1 and sets errno, which
+ *     is ETIMEDOUT if the last attempt ran out of time.
+ */
+int open_clientfd_deadline(char *hostname, char *port, long deadline) {
+    int clientfd = -1, rc, err = ECONNREFUSED;
+    struct addrinfo hints, *listp, *p;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    rc = getaddrinfo(hostname, port, &hints, &listp);
+    if (rc != 0) {
+      gai_error(rc, "Getaddrinfo error");
+      return -1;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (connect_deadline(clientfd, p->ai_addr, p->ai_addrlen, deadline) == 0)
+            break;
+        err = errno;
+        close(clientfd);
+    }
+
+    Freeaddrinfo(listp);
+    if (!p) {
+        errno = err;
+        return -1;
+    }
+    return clientfd;
+}
+
 /*  
  * open_listenfd - Open and return a listening socket on port. This
  *     function is reentrant and protocol-independent.
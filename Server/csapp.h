@@ -24,6 +24,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 /* $begin createmasks */
@@ -200,6 +202,15 @@ void rio_readinitb(rio_t *rp, int fd);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
+/* Deadline-aware Rio variants. A deadline is an absolute time from
+   rio_deadline(), or 0 for none. When it passes before the operation
+   completes, these return -1 with errno set to ETIMEDOUT. */
+long rio_deadline(int timeout_ms);
+ssize_t rio_writen_deadline(int fd, void *usrbuf, size_t n, long deadline);
+ssize_t rio_readnb_deadline(rio_t *rp, void *usrbuf, size_t n, long deadline);
+ssize_t rio_readlineb_deadline(rio_t *rp, void *usrbuf, size_t maxlen,
+                               long deadline);
+
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
@@ -211,6 +222,10 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
 
+/* Like open_clientfd, but gives up on each connect() at `deadline`
+   (name lookup itself is not bounded): */
+int open_clientfd_deadline(char *hostname, char *port, long deadline);
+
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
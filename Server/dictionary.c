@@ -90,6 +90,17 @@ void *dictionary_get(dictionary_t *d, const char *key) {
   return NULL;
 }
 
+int dictionary_has(dictionary_t *d, const char *key) {
+  int i;
+
+  for (i = 0; i < d->count; i++) {
+    if (same_key(key, d->keys[i], d->compare_mode))
+      return 1;
+  }
+
+  return 0;
+}
+
 size_t dictionary_count(dictionary_t *d) {
   return d->count;
 }
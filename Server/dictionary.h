@@ -40,6 +40,10 @@ void dictionary_remove(dictionary_t *d, const char *key);
    mapping for `key` is changed. */
 void *dictionary_get(dictionary_t *d, const char *key);
 
+/* Returns 1 if the dictionary has a mapping for `key` and 0
+   otherwise, which is useful when the mapped value can be NULL: */
+int dictionary_has(dictionary_t *d, const char *key);
+
 /* Returns the number of keys/values that are mapped in the
    dictionary: */
 size_t dictionary_count(dictionary_t *d);
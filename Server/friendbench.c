@@ -0,0 +1,129 @@
+/*
+ * friendbench.c - compare friendlist's HTTP and binary protocol paths.
+ *
+ * Runs the same mix of /befriend and /friends requests against both
+ * ports of one friendlist server and reports requests per second.
+ * HTTP requests each use a fresh connection, since the server always
+ * answers with "Connection: close"; binary requests are pipelined
+ * over a single connection, WINDOW at a time.
+ */
+#include "csapp.h"
+#include "dictionary.h"
+#include "more_string.h"
+#include "binproto.h"
+
+#define NUM_USERS 16
+#define WINDOW    64
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void user_name(char *buf, int i) {
+  sprintf(buf, "user %d", i % NUM_USERS);
+}
+
+static double run_http(char *host, char *port, int n) {
+  char buf[MAXLINE], user[64], friend[64];
+  char *e_user, *e_friend;
+  double start = now();
+  rio_t rio;
+  int i, fd;
+
+  for (i = 0; i < n; i++) {
+    user_name(user, i);
+    user_name(friend, i + 1);
+    e_user = query_encode(user);
+    e_friend = query_encode(friend);
+    if (i & 1)
+      sprintf(buf, "GET /friends?user=%s HTTP/1.0\r\n\r\n", e_user);
+    else
+      sprintf(buf, "GET /befriend?user=%s&friends=%s HTTP/1.0\r\n\r\n",
+              e_user, e_friend);
+    free(e_user);
+    free(e_friend);
+
+    fd = Open_clientfd(host, port);
+    Rio_writen(fd, buf, strlen(buf));
+    Rio_readinitb(&rio, fd);
+    while (Rio_readnb(&rio, buf, MAXLINE) > 0)
+      ;
+    Close(fd);
+  }
+
+  return now() - start;
+}
+
+static double run_binary(char *host, char *port, int n) {
+  char user[64], friend[64];
+  bp_buf_t out, in;
+  double start = now();
+  rio_t rio;
+  int i, j, batch, fd;
+  size_t frame;
+
+  bp_buf_init(&out);
+  bp_buf_init(&in);
+  fd = Open_clientfd(host, port);
+  Rio_readinitb(&rio, fd);
+
+  for (i = 0; i < n; i += batch) {
+    batch = ((n - i) < WINDOW ? (n - i) : WINDOW);
+
+    out.len = 0;
+    for (j = i; j < i + batch; j++) {
+      user_name(user, j);
+      user_name(friend, j + 1);
+      frame = bp_begin_frame(&out);
+      bp_put_varint(&out, j);
+      if (j & 1) {
+        bp_put_byte(&out, BP_OP_FRIENDS);
+        bp_put_string(&out, user, strlen(user));
+        bp_put_varint(&out, 0);
+      } else {
+        bp_put_byte(&out, BP_OP_BEFRIEND);
+        bp_put_string(&out, user, strlen(user));
+        bp_put_varint(&out, 1);
+        bp_put_string(&out, friend, strlen(friend));
+      }
+      bp_end_frame(&out, frame);
+    }
+    Rio_writen(fd, out.data, out.len);
+
+    for (j = 0; j < batch; j++) {
+      if (bp_read_frame(&rio, &in, 0) <= 0)
+        app_error("friendbench: binary connection failed");
+    }
+  }
+
+  Close(fd);
+  bp_buf_free(&out);
+  bp_buf_free(&in);
+
+  return now() - start;
+}
+
+int main(int argc, char **argv) {
+  int n = 10000;
+  double secs;
+
+  if ((argc != 4) && (argc != 5)) {
+    fprintf(stderr, "usage: %s <host> <port> <binary-port> [<requests>]\n",
+            argv[0]);
+    exit(1);
+  }
+  if (argc == 5)
+    n = atoi(argv[4]);
+
+  secs = run_http(argv[1], argv[2], n);
+  printf("http:   %d requests in %.3f secs = %.0f req/sec\n", n, secs,
+         n / secs);
+
+  secs = run_binary(argv[1], argv[3], n);
+  printf("binary: %d requests in %.3f secs = %.0f req/sec\n", n, secs,
+         n / secs);
+
+  return 0;
+}
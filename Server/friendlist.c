@@ -11,27 +11,72 @@
 #include "csapp.h"
 #include "dictionary.h"
 #include "more_string.h"
+#include "binproto.h"
+#include "hotkeys.h"
+
+/* How long a client has to send its whole request, and how long an
+   /introduce peer has to connect and answer, in milliseconds: */
+#define REQUEST_TIMEOUT_MS   10000
+#define INTRODUCE_TIMEOUT_MS 5000
+
+/* Connections served at once before new ones get a 503: */
+#define MAX_ACTIVE 1024
+
+/* How long a 503, or a 408 for a request out of time, may take to
+   send, in milliseconds: */
+#define ERROR_TIMEOUT_MS 100
+
+/* Preformatted error responses, indexes into `canned` below: */
+enum {
+  BAD_REQUEST,       /* 400 */
+  NOT_FOUND,         /* 404 */
+  REQUEST_TIMEOUT,   /* 408 */
+  TOO_MANY_REQUESTS, /* 429 */
+  NOT_IMPLEMENTED,   /* 501 */
+  UNAVAILABLE,       /* 503 */
+  NUM_CANNED
+};
 
 static void doit(int fd);
-static dictionary_t *read_requesthdrs(rio_t *rp);
-static void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d);
+static dictionary_t *read_requesthdrs(rio_t *rp, long deadline);
+static int read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d,
+                          long deadline);
 static void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
-                        char *longmsg);
+                        char *longmsg, long deadline);
+static void init_canned(void);
+static void cannederror(int fd, int which, long deadline);
 static void print_stringdictionary(dictionary_t *d);
 
 // responses
-static void serve_friends(int fd, dictionary_t *query);
-static void serve_introduce(int fd, dictionary_t *query);
-static void serve_befriend(int fd, dictionary_t *query);
-static void serve_unfriend(int fd, dictionary_t *query);
+static void serve_friends(int fd, dictionary_t *query, long deadline);
+static void serve_introduce(int fd, dictionary_t *query, long deadline);
+static void serve_befriend(int fd, dictionary_t *query, long deadline);
+static void serve_unfriend(int fd, dictionary_t *query, long deadline);
 // static void serve_greet(int fd, dictionary_t *query);
 
+// binary protocol
+static void *binary_listener(void *listenfd_p);
+static void *binary_thread(void *con);
+static void binary_serve(int fd);
+static int binary_request(bp_reader_t *r, bp_buf_t *out);
+static void put_friends(bp_buf_t *out, dictionary_t *d, dictionary_t *also,
+                        int intersect);
+
 // helper functions
-static void showPage(int fd, char *body);
+static void showPage(int fd, char *body, long deadline);
+static dictionary_t *friends_of(const char *user, int create);
+static void add_friendship(const char *user, const char *friend);
+static void remove_friendship(const char *user, const char *friend);
+static void friends_body(const char *user, str_buf_t *body);
+static void for_each_friend(const char *user, char *names,
+                            void (*f)(const char *, const char *));
+static void install_replica(const char *user);
+static void refresh_replica(const char *user);
 void *Athread(void *con);
 // varibles
 dictionary_t *friends;
 pthread_mutex_t lock;
+static int active; /* connections being served on either port, updated atomically */
 
 int main(int argc, char **argv) {
   int listenfd, connfd;
@@ -39,14 +84,26 @@ int main(int argc, char **argv) {
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  if ((argc != 2) && (argc != 3)) {
+    fprintf(stderr, "usage: %s <port> [<binary-port>]\n", argv[0]);
     exit(1);
   }
 
   pthread_mutex_init(&lock, NULL);
   listenfd = Open_listenfd(argv[1]);
   friends = make_dictionary(COMPARE_CASE_SENS, free);
+  hot_init();
+  init_canned();
+
+  /* The optional second port speaks the binary protocol, served by
+     its own accept loop against the same `friends` graph: */
+  if (argc == 3) {
+    int *binfd = malloc(sizeof(int));
+    pthread_t thread;
+    *binfd = Open_listenfd(argv[2]);
+    Pthread_create(&thread, NULL, binary_listener, binfd);
+    Pthread_detach(thread);
+  }
 
   /* Don't kill the server if there's an error, because
      we want to survive errors due to a client. But we
@@ -64,6 +121,14 @@ int main(int argc, char **argv) {
                   MAXLINE, 0);
       printf("Accepted connection from (%s, %s)\n", hostname, port);
 
+      // Shed load before spending a thread on it
+      if (__sync_fetch_and_add(&active, 1) >= MAX_ACTIVE) {
+        __sync_fetch_and_sub(&active, 1);
+        cannederror(connfd, UNAVAILABLE, rio_deadline(ERROR_TIMEOUT_MS));
+        Close(connfd);
+        continue;
+      }
+
       // Request memory
       int *con = malloc(sizeof(int));
       *con = connfd;
@@ -83,6 +148,7 @@ void *Athread(void *con) {
   free(con);
   doit(c);
   Close(c);
+  __sync_fetch_and_sub(&active, 1);
   return NULL;
 }
 
@@ -93,60 +159,59 @@ void doit(int fd) {
   char buf[MAXLINE], *method, *uri, *version;
   rio_t rio;
   dictionary_t *headers, *query;
+  long deadline = rio_deadline(REQUEST_TIMEOUT_MS);
+  ssize_t rc;
 
   /* Read request line and headers */
   Rio_readinitb(&rio, fd);
-  if (Rio_readlineb(&rio, buf, MAXLINE) <= 0)
+  if ((rc = rio_readlineb_deadline(&rio, buf, MAXLINE, deadline)) <= 0) {
+    if ((rc < 0) && (errno == ETIMEDOUT))
+      cannederror(fd, REQUEST_TIMEOUT, rio_deadline(ERROR_TIMEOUT_MS));
     return;
+  }
   printf("%s", buf);
 
   if (!parse_request_line(buf, &method, &uri, &version)) {
-    clienterror(fd, method, "400", "Bad Request",
-                "Friendlist did not recognize the request");
+    cannederror(fd, BAD_REQUEST, deadline);
   } else {
     if (strcasecmp(version, "HTTP/1.0") && strcasecmp(version, "HTTP/1.1")) {
-      clienterror(fd, version, "501", "Not Implemented",
-                  "Friendlist does not implement that version");
+      cannederror(fd, NOT_IMPLEMENTED, deadline);
     } else if (strcasecmp(method, "GET") && strcasecmp(method, "POST")) {
-      clienterror(fd, method, "501", "Not Implemented",
-                  "Friendlist does not implement that method");
+      cannederror(fd, NOT_IMPLEMENTED, deadline);
     } else {
-      headers = read_requesthdrs(&rio);
+      headers = read_requesthdrs(&rio, deadline);
 
       /* Parse all query arguments into a dictionary */
       query = make_dictionary(COMPARE_CASE_SENS, free);
 
       parse_uriquery(uri, query);
-      if (!strcasecmp(method, "POST"))
-        read_postquery(&rio, headers, query);
-
-      /* For debugging, print the dictionary */
-      print_stringdictionary(query);
-
-      /* You'll want to handle different queries here,
-         but the intial implementation always returns
-         nothing: */
-      if (starts_with("/friends", uri)) {
-        pthread_mutex_lock(&lock);
-        serve_friends(fd, query);
-        pthread_mutex_unlock(&lock);
-      } else if (starts_with("/befriend", uri)) {
-        pthread_mutex_lock(&lock);
-        serve_befriend(fd, query);
-        pthread_mutex_unlock(&lock);
-      } else if (starts_with("/unfriend", uri)) {
-        pthread_mutex_lock(&lock);
-        serve_unfriend(fd, query);
-        pthread_mutex_unlock(&lock);
-      } else if (starts_with("/introduce", uri)) {
-        serve_introduce(fd, query);
+      if (!headers || (!strcasecmp(method, "POST")
+                       && !read_postquery(&rio, headers, query, deadline))) {
+        if (errno == ETIMEDOUT)
+          cannederror(fd, REQUEST_TIMEOUT, rio_deadline(ERROR_TIMEOUT_MS));
+        else
+          cannederror(fd, BAD_REQUEST, deadline);
+      } else {
+        /* For debugging, print the dictionary */
+        print_stringdictionary(query);
+
+        if (starts_with("/friends", uri)) {
+          serve_friends(fd, query, deadline);
+        } else if (starts_with("/befriend", uri)) {
+          serve_befriend(fd, query, deadline);
+        } else if (starts_with("/unfriend", uri)) {
+          serve_unfriend(fd, query, deadline);
+        } else if (starts_with("/introduce", uri)) {
+          serve_introduce(fd, query, deadline);
+        } else {
+          cannederror(fd, NOT_FOUND, deadline);
+        }
       }
-      // else
-      //   serve_request(fd, query);
 
       /* Clean up */
       free_dictionary(query);
-      free_dictionary(headers);
+      if (headers)
+        free_dictionary(headers);
     }
 
     /* Clean up status line */
@@ -157,209 +222,570 @@ void doit(int fd) {
 }
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers, returning NULL with
+ *   errno set if reading fails or the deadline passes
  */
-dictionary_t *read_requesthdrs(rio_t *rp) {
+dictionary_t *read_requesthdrs(rio_t *rp, long deadline) {
   char buf[MAXLINE];
+  ssize_t rc;
   dictionary_t *d = make_dictionary(COMPARE_CASE_INSENS, free);
 
-  Rio_readlineb(rp, buf, MAXLINE);
-  printf("%s", buf);
-  while (strcmp(buf, "\r\n")) {
-    Rio_readlineb(rp, buf, MAXLINE);
+  /* the first line is the request or status line */
+  while ((rc = rio_readlineb_deadline(rp, buf, MAXLINE, deadline)) > 0) {
     printf("%s", buf);
+    if (!strcmp(buf, "\r\n"))
+      break;
     parse_header_line(buf, d);
   }
 
+  if (rc < 0) {
+    free_dictionary(d);
+    return NULL;
+  }
+
   return d;
 }
 
-void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest) {
+/*
+ * read_postquery - read a POST body into `dest`, returning 0 with
+ *   errno set if the body could not be read before the deadline
+ *   (EPROTO if the client closed the connection before sending all
+ *   of it)
+ */
+int read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest,
+                   long deadline) {
   char *len_str, *type, *buffer;
   int len;
+  ssize_t rc;
 
   len_str = dictionary_get(headers, "Content-Length");
   len = (len_str ? atoi(len_str) : 0);
+  if (len < 0)
+    len = 0;
 
   type = dictionary_get(headers, "Content-Type");
 
   buffer = malloc(len + 1);
-  Rio_readnb(rp, buffer, len);
+  if ((rc = rio_readnb_deadline(rp, buffer, len, deadline)) != len) {
+    if (rc >= 0)
+      errno = EPROTO;
+    free(buffer);
+    return 0;
+  }
   buffer[len] = 0;
 
-  if (!strcasecmp(type, "application/x-www-form-urlencoded")) {
+  if (type && !strcasecmp(type, "application/x-www-form-urlencoded")) {
     parse_query(buffer, dest);
   }
 
   free(buffer);
+  return 1;
 }
 
-static char *ok_header(size_t len, const char *content_type) {
-  char *len_str, *header;
-
-  header = append_strings(
-      "HTTP/1.0 200 OK\r\n", "Server: Friendlist Web Server\r\n",
-      "Connection: close\r\n", "Content-length: ", len_str = to_string(len),
-      "\r\n", "Content-type: ", content_type, "\r\n\r\n", NULL);
-
-  free(len_str);
-
-  return header;
+static void ok_header(char *header, size_t size, size_t len,
+                      const char *content_type) {
+  snprintf(header, size,
+           "HTTP/1.0 200 OK\r\n"
+           "Server: Friendlist Web Server\r\n"
+           "Connection: close\r\n"
+           "Content-length: %zu\r\n"
+           "Content-type: %s\r\n\r\n",
+           len, content_type);
 }
 
 /**
- * Helper method to show the friedns on the page
+ * Helper method to show the friedns on the page. A client that stops
+ * reading gets up to the request's deadline.
  */
-static void showPage(int fd, char *body) {
+static void showPage(int fd, char *body, long deadline) {
   size_t len = strlen(body);
-  char *header;
+  char header[MAXLINE];
 
   /* Send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
-  Rio_writen(fd, header, strlen(header));
+  ok_header(header, sizeof(header), len, "text/html; charset=utf-8");
+  if (rio_writen_deadline(fd, header, strlen(header), deadline) < 0)
+    return;
   printf("Response headers:\n");
   printf("%s", header);
 
-  free(header);
-
   /* Send response body to client */
-  Rio_writen(fd, body, len);
+  rio_writen_deadline(fd, body, len, deadline);
 }
 
 // All of the friends of the user
-static void serve_friends(int fd, dictionary_t *query) {
-  char *body;
+static void serve_friends(int fd, dictionary_t *query, long deadline) {
+  char space[MAXBUF];
+  str_buf_t body;
   char *user = dictionary_get(query, "user");
-  dictionary_t *userFriends = dictionary_get(friends, user);
 
-  if (!userFriends) {
-    body = "";
+  str_buf_init(&body, space, sizeof(space));
+
+  /* Heavily-read users are answered from this core's replica,
+     without taking the global lock */
+  if (!user) {
+    /* empty list */
+  } else if (hot_replica_get(user, &body)) {
+    /* promoted again after its replicas were dropped under us */
+    if (hot_sample(user)) {
+      pthread_mutex_lock(&lock);
+      install_replica(user);
+      pthread_mutex_unlock(&lock);
+    }
   } else {
-    body = join_strings(dictionary_keys(userFriends), '\n');
+    pthread_mutex_lock(&lock);
+    friends_body(user, &body);
+    if (hot_sample(user))
+      hot_replica_set(user, body.data);
+    pthread_mutex_unlock(&lock);
   }
 
-  showPage(fd, body);
+  showPage(fd, body.data, deadline);
+  str_buf_free(&body);
 }
 
 // add friend
-static void serve_befriend(int fd, dictionary_t *query) {
-  char *body;
+static void serve_befriend(int fd, dictionary_t *query, long deadline) {
+  char space[MAXBUF];
+  str_buf_t body;
   const char *user = dictionary_get(query, "user");
   // get new friend list
-  char **newFriends = split_string(dictionary_get(query, "friends"), '\n');
-
-  int i = 0;
-  // scanning
-  while (newFriends[i]) {
-    // If scanning node is not equal to the user
-    if (strcmp(newFriends[i], user)) {
-      // add friending to user
-      if (!dictionary_get(friends, newFriends[i])) {
-        dictionary_set(friends, newFriends[i],
-                       make_dictionary(COMPARE_CASE_INSENS, free));
-      }
-      dictionary_set(dictionary_get(friends, newFriends[i]), user, NULL);
-      // add user to friending
-      if (!dictionary_get(friends, user)) {
-        dictionary_set(friends, user,
-                       make_dictionary(COMPARE_CASE_INSENS, free));
-      }
-      dictionary_set(dictionary_get(friends, user), newFriends[i], NULL);
-    }
-    i++;
+  char *newFriends = dictionary_get(query, "friends");
+
+  str_buf_init(&body, space, sizeof(space));
+  if (user) {
+    pthread_mutex_lock(&lock);
+    if (newFriends)
+      for_each_friend(user, newFriends, add_friendship);
+    friends_body(user, &body);
+    pthread_mutex_unlock(&lock);
   }
 
-  body = join_strings(dictionary_keys(dictionary_get(friends, user)), '\n');
-  showPage(fd, body);
+  showPage(fd, body.data, deadline);
+  str_buf_free(&body);
 }
 
 // remove friend
-static void serve_unfriend(int fd, dictionary_t *query) {
-  char *body;
+static void serve_unfriend(int fd, dictionary_t *query, long deadline) {
+  char space[MAXBUF];
+  str_buf_t body;
   const char *user = dictionary_get(query, "user");
-  dictionary_t *user_friends = dictionary_get(friends, user);
   // get unfriend list
-  char **unfriends = split_string(dictionary_get(query, "friends"), '\n');
-
-  int i = 0;
-  // scanning the unfriending list
-  while (unfriends[i]) {
-    char *unfriending = unfriends[i]; // scanning node
-    // remove unfriending
-    dictionary_remove(user_friends, unfriending);
-    // remove user
-    dictionary_remove(dictionary_get(friends, unfriending), user);
-
-    i++;
+  char *unfriends = dictionary_get(query, "friends");
+
+  str_buf_init(&body, space, sizeof(space));
+  if (user) {
+    pthread_mutex_lock(&lock);
+    if (unfriends)
+      for_each_friend(user, unfriends, remove_friendship);
+    friends_body(user, &body);
+    pthread_mutex_unlock(&lock);
   }
 
-  body = join_strings(dictionary_keys(dictionary_get(friends, user)), '\n');
-  showPage(fd, body);
+  showPage(fd, body.data, deadline);
+  str_buf_free(&body);
 }
 
 // add all as the user's friends
-static void serve_introduce(int fd, dictionary_t *query) {
-  char *body;
+static void serve_introduce(int fd, dictionary_t *query, long deadline) {
+  char space[MAXBUF], rec_space[MAXBUF];
+  str_buf_t body;
+  char *encoded;
   char *host = dictionary_get(query, "host");
   char *port = dictionary_get(query, "port");
   const char *friend = dictionary_get(query, "friend");
   const char *user = dictionary_get(query, "user");
+  long peer_deadline = rio_deadline(INTRODUCE_TIMEOUT_MS);
+  dictionary_t *headers = NULL;
+  char *rec_buf = NULL;
+  rio_t rio;
+  int client;
+
+  if (!host || !port || !friend || !user) {
+    cannederror(fd, BAD_REQUEST, deadline);
+    return;
+  }
 
   // create buffer
   char buf[MAXBUF];
-  int client = Open_clientfd(host, port);
-  sprintf(buf, "GET /friends?user=%s HTTP/1.1\r\n\r\n", query_encode(friend));
-  Rio_writen(client, buf, strlen(buf));
+  client = open_clientfd_deadline(host, port, peer_deadline);
+  if (client < 0)
+    goto peer_failed;
+  encoded = query_encode(friend);
+  snprintf(buf, sizeof(buf), "GET /friends?user=%s HTTP/1.1\r\n\r\n",
+           encoded);
+  free(encoded);
+  if (rio_writen_deadline(client, buf, strlen(buf), peer_deadline) < 0)
+    goto peer_failed;
   Shutdown(client, SHUT_WR);
-  rio_t rio;
   Rio_readinitb(&rio, client);
 
-  dictionary_t *headers = read_requesthdrs(&rio);
+  if (!(headers = read_requesthdrs(&rio, peer_deadline)))
+    goto peer_failed;
   char *len_str = dictionary_get(headers, "Content-length");
   int len = (len_str ? atoi(len_str) : 0);
-  char rec_buf[len];
-  Rio_readnb(&rio, rec_buf, len);
+  if (len < 0)
+    len = 0;
+  rec_buf = (len < sizeof(rec_space) ? rec_space : malloc(len + 1));
+  if (rio_readnb_deadline(&rio, rec_buf, len, peer_deadline) != len)
+    goto peer_failed;
   rec_buf[len] = 0;
 
   // thread start
+  str_buf_init(&body, space, sizeof(space));
   pthread_mutex_lock(&lock);
-  char **newFriends = split_string(rec_buf, '\n');
-  int i = 0;
-  // scanning
-  while (newFriends[i]) {
-    // If scanning node is not equal to the user
-    if (strcmp(newFriends[i], user)) {
-      // add friending to user
-      if (!dictionary_get(friends, newFriends[i])) {
-        dictionary_set(friends, newFriends[i],
-                       make_dictionary(COMPARE_CASE_INSENS, free));
+  for_each_friend(user, rec_buf, add_friendship);
+  friends_body(user, &body);
+  pthread_mutex_unlock(&lock);
+  // thread end
+
+  showPage(fd, body.data, deadline);
+
+  str_buf_free(&body);
+  goto done;
+
+ peer_failed:
+  if (errno == ETIMEDOUT)
+    clienterror(fd, host, "504", "Gateway Timeout",
+                "Friendlist timed out waiting for the introducing server",
+                deadline);
+  else
+    clienterror(fd, host, "502", "Bad Gateway",
+                "Friendlist could not get friends from the introducing server",
+                deadline);
+ done:
+  if (rec_buf != rec_space)
+    free(rec_buf);
+  if (headers)
+    free_dictionary(headers);
+  if (client >= 0)
+    Close(client);
+}
+
+/**
+ * Returns the friend dictionary of the user, creating an empty one
+ * when `create` is set. The caller must hold `lock`.
+ */
+static dictionary_t *friends_of(const char *user, int create) {
+  dictionary_t *d = dictionary_get(friends, user);
+
+  if (!d && create) {
+    d = make_dictionary(COMPARE_CASE_INSENS, free);
+    dictionary_set(friends, user, d);
+  }
+
+  return d;
+}
+
+/**
+ * Appends the user's friends to `body`, each terminated by a newline.
+ * The caller must hold `lock`.
+ */
+static void friends_body(const char *user, str_buf_t *body) {
+  dictionary_t *d = friends_of(user, 0);
+  const char *key;
+  size_t i, n = (d ? dictionary_count(d) : 0);
+
+  str_buf_append(body, "", 0);
+  for (i = 0; i < n; i++) {
+    key = dictionary_key(d, i);
+    str_buf_append(body, key, strlen(key));
+    str_buf_append(body, "\n", 1);
+  }
+}
+
+/**
+ * Applies `f` to the user and each newline-separated name in `names`.
+ * Each name is viewed in place and terminated by overwriting its
+ * separator, so `names` must be a buffer that the caller owns.
+ */
+static void for_each_friend(const char *user, char *names,
+                            void (*f)(const char *, const char *)) {
+  const char *rest = names;
+  str_view_t v;
+
+  while (next_split_view(&rest, '\n', &v)) {
+    ((char *)v.ptr)[v.len] = 0;
+    f(user, v.ptr);
+  }
+}
+
+// give a newly hot user replicas on every core
+static void install_replica(const char *user) {
+  char space[MAXBUF];
+  str_buf_t body;
+
+  str_buf_init(&body, space, sizeof(space));
+  friends_body(user, &body);
+  hot_replica_set(user, body.data);
+  str_buf_free(&body);
+}
+
+// rebuild a hot user's replicas after their friends change
+static void refresh_replica(const char *user) {
+  char space[MAXBUF];
+  str_buf_t body;
+
+  if (hot_replica_has(user)) {
+    str_buf_init(&body, space, sizeof(space));
+    friends_body(user, &body);
+    hot_replica_refresh(user, body.data);
+    str_buf_free(&body);
+  }
+}
+
+// make two users friends of each other, ignoring self-friending
+static void add_friendship(const char *user, const char *friend) {
+  if (strcmp(user, friend)) {
+    dictionary_set(friends_of(friend, 1), user, NULL);
+    dictionary_set(friends_of(user, 1), friend, NULL);
+    refresh_replica(user);
+    refresh_replica(friend);
+  }
+}
+
+// undo add_friendship
+static void remove_friendship(const char *user, const char *friend) {
+  dictionary_t *d;
+
+  if ((d = friends_of(user, 0)))
+    dictionary_remove(d, friend);
+  if ((d = friends_of(friend, 0)))
+    dictionary_remove(d, user);
+  refresh_replica(user);
+  refresh_replica(friend);
+}
+
+/**
+ * Accept loop for the binary protocol port
+ */
+static void *binary_listener(void *listenfd_p) {
+  int listenfd = *(int *)listenfd_p;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+
+  free(listenfd_p);
+
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    int connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd >= 0) {
+      // Binary clients count against the same cap; there is no error
+      // frame for a request not yet read, so just hang up
+      if (__sync_fetch_and_add(&active, 1) >= MAX_ACTIVE) {
+        __sync_fetch_and_sub(&active, 1);
+        Close(connfd);
+        continue;
       }
-      dictionary_set(dictionary_get(friends, newFriends[i]), user, NULL);
-      // add user to friending
-      if (!dictionary_get(friends, user)) {
-        dictionary_set(friends, user,
-                       make_dictionary(COMPARE_CASE_INSENS, free));
+
+      int *con = malloc(sizeof(int));
+      *con = connfd;
+      pthread_t thread;
+      Pthread_create(&thread, NULL, binary_thread, con);
+      Pthread_detach(thread);
+    }
+  }
+
+  return NULL;
+}
+
+static void *binary_thread(void *con) {
+  int c = *(int *)con;
+  free(con);
+  binary_serve(c);
+  Close(c);
+  __sync_fetch_and_sub(&active, 1);
+  return NULL;
+}
+
+/*
+ * binary_serve - handle binary protocol requests until the client
+ *   closes the connection, or until a batch of requests is not read
+ *   and answered within REQUEST_TIMEOUT_MS of the last response.
+ *   Responses to pipelined requests are batched and sent once no
+ *   further request bytes are buffered.
+ */
+static void binary_serve(int fd) {
+  rio_t rio;
+  bp_buf_t in, out;
+  bp_reader_t r;
+  ssize_t len;
+  long deadline = rio_deadline(REQUEST_TIMEOUT_MS);
+
+  bp_buf_init(&in);
+  bp_buf_init(&out);
+  Rio_readinitb(&rio, fd);
+
+  while ((len = bp_read_frame(&rio, &in, deadline)) > 0) {
+    bp_reader_init(&r, in.data, len);
+    if (!binary_request(&r, &out))
+      break;
+    if (rio.rio_cnt <= 0) {
+      if (rio_writen_deadline(fd, out.data, out.len, deadline) != out.len)
+        break;
+      out.len = 0;
+      deadline = rio_deadline(REQUEST_TIMEOUT_MS);
+    }
+  }
+
+  if (out.len)
+    rio_writen_deadline(fd, out.data, out.len, deadline);
+
+  bp_buf_free(&in);
+  bp_buf_free(&out);
+}
+
+/*
+ * binary_request - decode one request payload and append its response
+ *   frame to `out`. Returns 0 if the payload was malformed, after
+ *   appending an error response when an id could be decoded.
+ */
+static int binary_request(bp_reader_t *r, bp_buf_t *out) {
+  unsigned long id, count = 0, i;
+  int op = 0, status = BP_STATUS_OK;
+  const char *s;
+  size_t len, start;
+  char *user = NULL, **names = NULL;
+
+  if (!bp_get_varint(r, &id))
+    return 0;
+
+  start = bp_begin_frame(out);
+  bp_put_varint(out, id);
+
+  /* every name takes at least its one-byte length, which bounds
+     `count` before we allocate for it */
+  if (!bp_get_byte(r, &op) || !bp_get_string(r, &s, &len)
+      || !bp_get_varint(r, &count) || (count > (size_t)(r->end - r->p))) {
+    status = BP_STATUS_BAD_FRAME;
+    count = 0;
+  } else {
+    user = strndup(s, len);
+    names = calloc(count + 1, sizeof(char *));
+    for (i = 0; i < count; i++) {
+      if (!bp_get_string(r, &s, &len)) {
+        status = BP_STATUS_BAD_FRAME;
+        break;
       }
-      dictionary_set(dictionary_get(friends, user), newFriends[i], NULL);
+      names[i] = strndup(s, len);
     }
-    i++;
   }
-  free(newFriends);
-  pthread_mutex_unlock(&lock);
-  // thread end
 
-  body = join_strings(dictionary_keys(dictionary_get(friends, user)), '\n');
-  showPage(fd, body);
+  if ((status == BP_STATUS_OK)
+      && (((op == BP_OP_FRIENDS) && count)
+          || ((op == BP_OP_MUTUAL) && (count != 1))
+          || (op < BP_OP_FRIENDS) || (op > BP_OP_MUTUAL)))
+    status = BP_STATUS_BAD_OP;
+
+  bp_put_byte(out, status);
+  if (status == BP_STATUS_OK) {
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < count; i++) {
+      if (op == BP_OP_BEFRIEND)
+        add_friendship(user, names[i]);
+      else if (op == BP_OP_UNFRIEND)
+        remove_friendship(user, names[i]);
+    }
+    if (op == BP_OP_MUTUAL)
+      put_friends(out, friends_of(user, 0), friends_of(names[0], 0), 1);
+    else
+      put_friends(out, friends_of(user, 0), NULL, 0);
+    pthread_mutex_unlock(&lock);
+  } else {
+    bp_put_varint(out, 0);
+  }
+  bp_end_frame(out, start);
 
-  free(body);
-  Close(client);
+  for (i = 0; names && names[i]; i++)
+    free(names[i]);
+  free(names);
+  free(user);
+
+  return status != BP_STATUS_BAD_FRAME;
+}
+
+/*
+ * put_friends - append the names in `d` as a count plus strings,
+ *   keeping only names also in `also` when `intersect` is set. Either
+ *   dictionary can be NULL for a user with no friends.
+ */
+static void put_friends(bp_buf_t *out, dictionary_t *d, dictionary_t *also,
+                        int intersect) {
+  size_t i, n, count = 0;
+  const char *s;
+
+  if (intersect && !also)
+    d = NULL;
+  n = (d ? dictionary_count(d) : 0);
+
+  for (i = 0; i < n; i++)
+    if (!intersect || dictionary_has(also, dictionary_key(d, i)))
+      count++;
+
+  bp_put_varint(out, count);
+  for (i = 0; i < n; i++) {
+    s = dictionary_key(d, i);
+    if (!intersect || dictionary_has(also, s))
+      bp_put_string(out, s, strlen(s));
+  }
+}
+
+/* The fixed errors, formatted once by init_canned() so that sending
+   one is a single write with no allocation --- garbage requests and
+   overload are exactly when we can least afford more work: */
+static struct {
+  const char *status, *longmsg;
+  char *response;
+  size_t len;
+} canned[NUM_CANNED] = {
+  [BAD_REQUEST] = { "400 Bad Request",
+                    "Friendlist did not recognize the request" },
+  [NOT_FOUND] = { "404 Not Found",
+                  "Friendlist does not serve that URI" },
+  [REQUEST_TIMEOUT] = { "408 Request Timeout",
+                        "Friendlist timed out waiting for the request" },
+  [TOO_MANY_REQUESTS] = { "429 Too Many Requests",
+                          "Friendlist is limiting requests from this client" },
+  [NOT_IMPLEMENTED] = { "501 Not Implemented",
+                        "Friendlist does not implement that request" },
+  [UNAVAILABLE] = { "503 Service Unavailable",
+                    "Friendlist is overloaded; try again later" },
+};
+
+static void init_canned(void) {
+  char body[MAXLINE];
+  int i, body_len;
+
+  for (i = 0; i < NUM_CANNED; i++) {
+    body_len = snprintf(body, sizeof(body),
+                        "<html><title>Friendlist Error</title>"
+                        "<body bgcolor=ffffff>\r\n"
+                        "%s<p>%s<hr><em>Friendlist Server</em>\r\n",
+                        canned[i].status, canned[i].longmsg);
+    canned[i].response = malloc(MAXLINE + body_len);
+    canned[i].len = snprintf(canned[i].response, MAXLINE + body_len,
+                             "HTTP/1.0 %s\r\n"
+                             "Server: Friendlist Web Server\r\n"
+                             "Connection: close\r\n"
+                             "Content-type: text/html; charset=utf-8\r\n"
+                             "Content-length: %d\r\n\r\n%s",
+                             canned[i].status, body_len, body);
+  }
+}
+
+/*
+ * cannederror - sends one of the preformatted error responses, giving
+ *   up at the deadline
+ */
+static void cannederror(int fd, int which, long deadline) {
+  /* a client that hung up or stopped reading gets nothing, and that's fine */
+  rio_writen_deadline(fd, canned[which].response, canned[which].len, deadline);
 }
 
 /*
  * clienterror - returns an error message to the client
  */
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
-                 char *longmsg) {
+                 char *longmsg, long deadline) {
   size_t len;
   char *header, *body, *len_str;
 
@@ -378,8 +804,8 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
                           "\r\n\r\n", NULL);
   free(len_str);
 
-  Rio_writen(fd, header, strlen(header));
-  Rio_writen(fd, body, len);
+  if (rio_writen_deadline(fd, header, strlen(header), deadline) >= 0)
+    rio_writen_deadline(fd, body, len, deadline);
 
   free(header);
   free(body);
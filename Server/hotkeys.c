@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include "dictionary.h"
+#include "more_string.h"
+#include "hotkeys.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024
+#define MAX_CORES    64
+
+/* One core's replicas, padded so that cores never share a line: */
+typedef struct {
+  pthread_mutex_t m;
+  int count;
+  char *keys[HOT_MAX_KEYS];
+  char *bodies[HOT_MAX_KEYS];
+} __attribute__((aligned(64))) core_table_t;
+
+typedef struct {
+  char *key;
+  unsigned estimate;
+  int replicated;
+} top_entry_t;
+
+static pthread_mutex_t sketch_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+static top_entry_t top[HOT_MAX_KEYS];
+static unsigned samples;
+
+static core_table_t *cores;
+static int num_cores;
+
+static __thread unsigned rng_state;
+
+static void drop_replicas(const char *key);
+
+void hot_init(void) {
+  int i;
+
+  num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cores < 1)
+    num_cores = 1;
+  if (num_cores > MAX_CORES)
+    num_cores = MAX_CORES;
+
+  if (posix_memalign((void **)&cores, 64, num_cores * sizeof(core_table_t)))
+    abort();
+  memset(cores, 0, num_cores * sizeof(core_table_t));
+  for (i = 0; i < num_cores; i++)
+    pthread_mutex_init(&cores[i].m, NULL);
+}
+
+/* FNV-1a, with the row folded into the offset basis so that each
+   sketch row hashes independently: */
+static unsigned hash(const char *key, int row) {
+  unsigned h = 2166136261u ^ (row * 0x9E3779B9u);
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+
+  return h ^ (h >> 15);
+}
+
+static top_entry_t *find_top(const char *key) {
+  int i;
+
+  for (i = 0; i < HOT_MAX_KEYS; i++) {
+    if (top[i].key && !strcmp(top[i].key, key))
+      return &top[i];
+  }
+
+  return NULL;
+}
+
+/* Halves every count, dropping replicas of keys that have cooled
+   below half of the promotion threshold. */
+static void decay(void) {
+  int i, j;
+
+  for (i = 0; i < SKETCH_DEPTH; i++)
+    for (j = 0; j < SKETCH_WIDTH; j++)
+      sketch[i][j] >>= 1;
+
+  for (i = 0; i < HOT_MAX_KEYS; i++) {
+    top[i].estimate >>= 1;
+    if (top[i].replicated && (top[i].estimate < HOT_THRESHOLD / 2)) {
+      drop_replicas(top[i].key);
+      top[i].replicated = 0;
+    }
+  }
+}
+
+/* Sampling must be random rather than every Nth read, since the
+   server runs each connection on a fresh thread. xorshift32, seeded
+   per thread from the clock and the thread's own address: */
+static int sampled(void) {
+  unsigned x = rng_state;
+
+  if (!x) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    x = (unsigned)ts.tv_nsec ^ (unsigned)(size_t)&rng_state;
+    if (!x)
+      x = 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rng_state = x;
+
+  return (x % HOT_SAMPLE_RATE) == 0;
+}
+
+int hot_sample(const char *key) {
+  unsigned estimate = ~0u;
+  top_entry_t *t, *min;
+  int i, promote = 0;
+
+  if (!sampled())
+    return 0;
+
+  pthread_mutex_lock(&sketch_lock);
+
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    unsigned *c = &sketch[i][hash(key, i) % SKETCH_WIDTH];
+    if (++*c < estimate)
+      estimate = *c;
+  }
+
+  if (!(t = find_top(key))) {
+    min = &top[0];
+    for (i = 1; i < HOT_MAX_KEYS; i++) {
+      if (!top[i].key || (min->key && (top[i].estimate < min->estimate)))
+        min = &top[i];
+    }
+    if (!min->key || (estimate > min->estimate)) {
+      if (min->replicated)
+        drop_replicas(min->key);
+      free(min->key);
+      min->key = strdup(key);
+      min->replicated = 0;
+      t = min;
+    }
+  }
+
+  if (t) {
+    t->estimate = estimate;
+    if (!t->replicated && (estimate >= HOT_THRESHOLD)) {
+      t->replicated = 1;
+      promote = 1;
+    }
+  }
+
+  if (++samples % HOT_DECAY_SAMPLES == 0)
+    decay();
+
+  pthread_mutex_unlock(&sketch_lock);
+
+  return promote;
+}
+
+static core_table_t *my_core(void) {
+  int cpu = sched_getcpu();
+  return &cores[(cpu < 0 ? 0 : cpu) % num_cores];
+}
+
+static int find_key(core_table_t *c, const char *key) {
+  int i;
+
+  for (i = 0; i < c->count; i++) {
+    if (!strcmp(c->keys[i], key))
+      return i;
+  }
+
+  return -1;
+}
+
+int hot_replica_get(const char *key, str_buf_t *out) {
+  core_table_t *c = my_core();
+  int i;
+
+  pthread_mutex_lock(&c->m);
+  if ((i = find_key(c, key)) >= 0)
+    str_buf_append(out, c->bodies[i], strlen(c->bodies[i]));
+  pthread_mutex_unlock(&c->m);
+
+  return i >= 0;
+}
+
+int hot_replica_has(const char *key) {
+  core_table_t *c = my_core();
+  int found;
+
+  pthread_mutex_lock(&c->m);
+  found = (find_key(c, key) >= 0);
+  pthread_mutex_unlock(&c->m);
+
+  return found;
+}
+
+/* Installs or replaces the replica of `key` on every core, adding it
+   only when `add` is set. */
+static void store_replicas(const char *key, const char *body, int add) {
+  core_table_t *c;
+  int n, i;
+
+  for (n = 0; n < num_cores; n++) {
+    c = &cores[n];
+    pthread_mutex_lock(&c->m);
+    if ((i = find_key(c, key)) >= 0) {
+      free(c->bodies[i]);
+      c->bodies[i] = strdup(body);
+    } else if (add && (c->count < HOT_MAX_KEYS)) {
+      c->keys[c->count] = strdup(key);
+      c->bodies[c->count] = strdup(body);
+      c->count++;
+    }
+    pthread_mutex_unlock(&c->m);
+  }
+}
+
+void hot_replica_set(const char *key, const char *body) {
+  top_entry_t *t;
+
+  /* Check under the sketch lock that `key` was not demoted since it
+     was promoted, so that replicas never outlive their tracking. */
+  pthread_mutex_lock(&sketch_lock);
+  t = find_top(key);
+  if (t && t->replicated)
+    store_replicas(key, body, 1);
+  pthread_mutex_unlock(&sketch_lock);
+}
+
+void hot_replica_refresh(const char *key, const char *body) {
+  store_replicas(key, body, 0);
+}
+
+static void drop_replicas(const char *key) {
+  core_table_t *c;
+  int n, i;
+
+  for (n = 0; n < num_cores; n++) {
+    c = &cores[n];
+    pthread_mutex_lock(&c->m);
+    if ((i = find_key(c, key)) >= 0) {
+      free(c->keys[i]);
+      free(c->bodies[i]);
+      c->count--;
+      c->keys[i] = c->keys[c->count];
+      c->bodies[i] = c->bodies[c->count];
+    }
+    pthread_mutex_unlock(&c->m);
+  }
+}
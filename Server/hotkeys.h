@@ -0,0 +1,46 @@
+/* Hot-key detection and per-core read replicas.
+
+   A sampled count-min sketch with a small top-k table finds the few
+   keys (users) that receive most reads. A key whose estimate crosses
+   HOT_THRESHOLD is "promoted": its caller installs a replica of the
+   response body in every core's table, and later reads on any core
+   are answered from that core's copy without touching the shared
+   store or its lock. Counts decay periodically, and keys that cool
+   off are dropped from the replica tables again. */
+
+/* Number of tracked keys, and therefore the most replicas at once: */
+#define HOT_MAX_KEYS 8
+
+/* On average, one of every HOT_SAMPLE_RATE reads is counted: */
+#define HOT_SAMPLE_RATE 16
+
+/* Sampled-count estimate at which a key is promoted; a replicated
+   key is dropped when it decays below half of this: */
+#define HOT_THRESHOLD 64
+
+/* Counts are halved after every HOT_DECAY_SAMPLES samples: */
+#define HOT_DECAY_SAMPLES 4096
+
+/* Initializes the sketch and one replica table per online core: */
+void hot_init(void);
+
+/* Records one read of `key`. Returns 1 exactly once when `key`
+   becomes hot, in which case the caller should install its replica
+   with hot_replica_set() while still holding the lock that protects
+   the underlying data; returns 0 otherwise. */
+int hot_sample(const char *key);
+
+/* Appends the calling core's replica of `key` to `out` and returns
+   1, or returns 0 if `key` is not replicated: */
+int hot_replica_get(const char *key, str_buf_t *out);
+
+/* Installs `body` as the replica of `key` on every core. */
+void hot_replica_set(const char *key, const char *body);
+
+/* Returns 1 if `key` currently has replicas: */
+int hot_replica_has(const char *key);
+
+/* Replaces the replicas of `key` with `body` if `key` is replicated,
+   and does nothing otherwise. Call it, with the data lock held,
+   after every change that affects `key`'s response. */
+void hot_replica_refresh(const char *key, const char *body);
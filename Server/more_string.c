@@ -101,6 +101,61 @@ char *join_strings(const char * const *strs, char sep) {
   return str;
 }
 
+int next_split_view(const char **str, char sep, str_view_t *v) {
+  const char *s = *str, *e;
+
+  if (!*s)
+    return 0;
+
+  e = strchr(s, sep);
+  if (!e)
+    e = s + strlen(s);
+
+  v->ptr = s;
+  v->len = e - s;
+  *str = (*e ? e + 1 : e);
+
+  return 1;
+}
+
+void str_buf_init(str_buf_t *b, char *storage, size_t size) {
+  b->storage = storage;
+  b->storage_size = size;
+  b->data = storage;
+  b->alloc = (storage ? size : 0);
+  b->len = 0;
+  if (b->data)
+    b->data[0] = 0;
+}
+
+void str_buf_free(str_buf_t *b) {
+  if (b->data != b->storage)
+    free(b->data);
+  str_buf_init(b, b->storage, b->storage_size);
+}
+
+void str_buf_append(str_buf_t *b, const char *s, size_t len) {
+  size_t alloc;
+
+  if (b->len + len + 1 > b->alloc) {
+    alloc = 2 * (b->alloc + 32);
+    while (b->len + len + 1 > alloc)
+      alloc *= 2;
+    if (b->data == b->storage) {
+      char *data = malloc(alloc);
+      memcpy(data, b->data, b->len);
+      b->data = data;
+    } else {
+      b->data = realloc(b->data, alloc);
+    }
+    b->alloc = alloc;
+  }
+
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+  b->data[b->len] = 0;
+}
+
 int parse_three(const char *buf,
                 char **one_p, char **two_p, char **three_p,
                 int extra_space_ok) {
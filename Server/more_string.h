@@ -31,6 +31,37 @@ char **split_string(const char *str, char sep);
    one string with `sep` added as a terminator after each string. */
 char *join_strings(const char * const *strs, char sep);
 
+/* A view of `len` bytes starting at `ptr` in some other string; the
+   bytes are not necessarily followed by a terminator: */
+typedef struct {
+  const char *ptr;
+  size_t len;
+} str_view_t;
+
+/* Finds the next piece of `*str` that is separated/terminated by
+   `sep`, with the same rules as split_string(), and sets `v` to view
+   it and `*str` to the rest of the string. Returns 0 when no pieces
+   are left. Nothing is allocated.
+
+   For example, repeatedly calling next_split_view() on "a\n\nb\n"
+   produces views of "a", "", and "b" and then returns 0. */
+int next_split_view(const char **str, char sep, str_view_t *v);
+
+/* A growable output buffer. The caller can supply initial storage
+   (typically on the stack), which is used until the content
+   outgrows it; only then is a buffer `malloc`ed. The content is
+   terminated whenever `data` is non-NULL. */
+typedef struct {
+  char *data;
+  size_t len, alloc;
+  char *storage;
+  size_t storage_size;
+} str_buf_t;
+
+void str_buf_init(str_buf_t *b, char *storage, size_t size);
+void str_buf_free(str_buf_t *b);
+void str_buf_append(str_buf_t *b, const char *s, size_t len);
+
 /* Parses an HTTP request line, returning 0 if parsing fails
    and 1 otherwise. If parsing succeeds, `method_p`, `uri_p`,
    and `version_p` are set to `malloc`ed strings for the
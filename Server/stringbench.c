@@ -0,0 +1,114 @@
+/*
+ * stringbench.c - allocations and time per request for friendlist's
+ * name-list handling.
+ *
+ * Replays the string work of one /befriend request (split the posted
+ * names, then list the user's friends) with the allocating
+ * split_string()/join_strings() pair and with the view-based
+ * next_split_view()/str_buf_t pair that friendlist uses. malloc and
+ * friends are interposed to count calls, which relies on glibc's
+ * __libc_ entry points.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "dictionary.h"
+#include "more_string.h"
+
+#define NUM_NAMES   20
+#define NUM_FRIENDS 50
+#define REQUESTS    100000
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static long allocs;
+
+void *malloc(size_t n) { allocs++; return __libc_malloc(n); }
+void *calloc(size_t n, size_t m) { allocs++; return __libc_calloc(n, m); }
+void *realloc(void *p, size_t n) { allocs++; return __libc_realloc(p, n); }
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static volatile size_t sink;
+
+static void old_request(const char *posted, dictionary_t *d) {
+  char **names = split_string(posted, '\n');
+  const char **keys;
+  char *body;
+  int i;
+
+  for (i = 0; names[i]; i++) {
+    sink += strlen(names[i]);
+    free(names[i]);
+  }
+  free(names);
+
+  keys = dictionary_keys(d);
+  body = join_strings(keys, '\n');
+  sink += strlen(body);
+  free(keys);
+  free(body);
+}
+
+static void new_request(const char *posted, dictionary_t *d) {
+  char space[8192];
+  const char *rest = posted, *key;
+  str_view_t v;
+  str_buf_t body;
+  size_t i;
+
+  while (next_split_view(&rest, '\n', &v))
+    sink += v.len;
+
+  str_buf_init(&body, space, sizeof(space));
+  for (i = 0; i < dictionary_count(d); i++) {
+    key = dictionary_key(d, i);
+    str_buf_append(&body, key, strlen(key));
+    str_buf_append(&body, "\n", 1);
+  }
+  sink += body.len;
+  str_buf_free(&body);
+}
+
+static void run(const char *label, void (*f)(const char *, dictionary_t *),
+                const char *posted, dictionary_t *d) {
+  long before = allocs;
+  double start = now(), secs;
+  int i;
+
+  for (i = 0; i < REQUESTS; i++)
+    f(posted, d);
+
+  secs = now() - start;
+  printf("%-10s %5.1f allocs/request  %7.3f usec/request\n", label,
+         (double)(allocs - before) / REQUESTS, secs * 1e6 / REQUESTS);
+}
+
+int main(void) {
+  char posted[4096], name[64];
+  dictionary_t *d = make_dictionary(COMPARE_CASE_INSENS, NULL);
+  int i;
+
+  posted[0] = 0;
+  for (i = 0; i < NUM_NAMES; i++) {
+    sprintf(name, "new friend %d\n", i);
+    strcat(posted, name);
+  }
+  for (i = 0; i < NUM_FRIENDS; i++) {
+    sprintf(name, "friend %d", i);
+    dictionary_set(d, name, NULL);
+  }
+
+  run("split/join", old_request, posted, d);
+  run("views", new_request, posted, d);
+
+  free_dictionary(d);
+  return 0;
+}